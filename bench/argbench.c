@@ -0,0 +1,497 @@
+/*	argbench
+	Copyright 2015 libdll.so
+
+	This program is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation; either version 2 of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+*/
+
+/*	Times the argument translation of the wrappers without running any
+	compiler.  The wrapper source is built into this program with its main()
+	renamed, and every malloc, realloc, calloc and strdup it makes is
+	counted.  Build it from the top directory with
+
+		cc -O2 -o argbench bench/argbench.c
+
+	for cc2cl's main(), with start_cl() replaced by a stub, or with
+
+		cc -O2 -DBENCH_CL2CC -o argbench-cl2cc bench/argbench.c
+
+	for cl2cc's add_arg() and respfile_expand().
+
+	The built-in corpus goes from a 10-argument compile to a 10000-argument
+	link; '-f <file>' adds command lines of a real build, one per line, as
+	printed by 'make -n'.  The path mapping cache stays warm from one run to
+	the next, which it would not across the processes of a build.
+*/
+
+#ifdef BENCH_CL2CC
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <signal.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#else
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#endif
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <ctype.h>
+#include <assert.h>
+#include <stdint.h>
+#include <time.h>
+
+#define MIN_RUNS 3
+#define MIN_TIME 200000000		// In nanoseconds, for each command line
+#define MAX_RUNS 10000			// The response files stay mapped
+
+static unsigned long int allocations;
+
+static void *counted_malloc(size_t size) {
+	allocations++;
+	return malloc(size);
+}
+
+static void *counted_realloc(void *p, size_t size) {
+	allocations++;
+	return realloc(p, size);
+}
+
+#ifndef BENCH_CL2CC
+// Only cc2cl calls calloc
+static void *counted_calloc(size_t n, size_t size) {
+	allocations++;
+	return calloc(n, size);
+}
+#endif
+
+static char *counted_strdup(const char *s) {
+	allocations++;
+	return strdup(s);
+}
+
+#define malloc counted_malloc
+#define realloc counted_realloc
+#ifndef BENCH_CL2CC
+#define calloc counted_calloc
+#endif
+#define strdup counted_strdup
+#define main wrapper_main
+#ifdef BENCH_CL2CC
+#include "../cl2cc.c"
+#else
+#define CC2CL_BENCHMARK
+#include "../cc2cl.c"
+#endif
+#undef main
+#undef malloc
+#undef realloc
+#undef calloc
+#undef strdup
+
+struct command_line {
+	char *name;
+	int argc;
+	char **argv;
+};
+
+static struct command_line *corpus;
+static unsigned int corpus_count;
+
+static void *xmalloc(size_t size) {
+	void *r = malloc(size);
+	if(!r) {
+		perror(NULL);
+		abort();
+	}
+	return r;
+}
+
+static char *xstrdup(const char *s) {
+	char *r = strdup(s);
+	if(!r) {
+		perror(NULL);
+		abort();
+	}
+	return r;
+}
+
+static uint64_t now_ns() {
+#ifdef _WIN32
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	if(!frequency.QuadPart) QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)counter.QuadPart / frequency.QuadPart * 1000000000 +
+		(uint64_t)counter.QuadPart % frequency.QuadPart * 1000000000 / frequency.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static void add_command_line(char *name, int argc, char **argv) {
+	corpus = realloc(corpus, (corpus_count + 1) * sizeof *corpus);
+	if(!corpus) {
+		perror(NULL);
+		abort();
+	}
+	corpus[corpus_count].name = name;
+	corpus[corpus_count].argc = argc;
+	corpus[corpus_count].argv = argv;
+	corpus_count++;
+}
+
+/*	Shaped after real builds: a compile has its -D and -I options, with
+	some directories given twice and some macro values quoted, and a link
+	is mostly objects with a few -L and -l options.
+*/
+static void generate_command_line(const char *name, int argc, int link) {
+	char **argv = xmalloc((argc + 1) * sizeof(char *));
+	char buffer[64];
+	int n = 0, i = 0;
+	argv[n++] = xstrdup("cc2cl");
+	if(link) {
+		argv[n++] = xstrdup("-o");
+		argv[n++] = xstrdup("bin/program");
+	} else {
+		argv[n++] = xstrdup("-c");
+		argv[n++] = xstrdup("-O2");
+		argv[n++] = xstrdup("-g");
+		argv[n++] = xstrdup("-Wall");
+		argv[n++] = xstrdup("-o");
+		argv[n++] = xstrdup("obj/module/source.o");
+		argv[n++] = xstrdup("src/module/source.c");
+	}
+	while(n < argc) {
+		if(link) switch(i % 10) {
+			case 0:
+				sprintf(buffer, "-Llib/component%d", i / 10);
+				break;
+			case 1:
+				sprintf(buffer, "-lcomponent%d", i / 10);
+				break;
+			default:
+				sprintf(buffer, "obj/component%d/source%d.o", i / 10, i % 10);
+				break;
+		} else switch(i % 4) {
+			case 0:
+			case 1:
+				sprintf(buffer, "-Isrc/module%d/include", i % 32 == 1 ? 0 : i);
+				break;
+			case 2:
+				sprintf(buffer, "-DHAVE_FEATURE_%d=1", i);
+				break;
+			case 3:
+				sprintf(buffer, i % 64 == 3 ? "-DVERSION_STRING_%d=\"1.0 beta\"" : "-DCONFIG_OPTION_%d", i);
+				break;
+		}
+		argv[n++] = xstrdup(buffer);
+		i++;
+	}
+	argv[n] = NULL;
+	add_command_line(xstrdup(name), argc, argv);
+}
+
+// One command line per line, split at blanks outside of double quotes
+static int load_corpus(const char *file) {
+	FILE *f = fopen(file, "r");
+	if(!f) {
+		perror(file);
+		return -1;
+	}
+	size_t size = 4096;
+	char *line = xmalloc(size);
+	unsigned int line_number = 0;
+	while(1) {
+		size_t len = 0;
+		int c;
+		while((c = getc(f)) != EOF && c != '\n') {
+			if(len + 1 >= size) {
+				size *= 2;
+				line = realloc(line, size);
+				if(!line) {
+					perror(NULL);
+					abort();
+				}
+			}
+			line[len++] = c;
+		}
+		if(c == EOF && !len) break;
+		line[len] = 0;
+		line_number++;
+		char **argv = xmalloc((len / 2 + 2) * sizeof(char *)), *p = line, *q = line;
+		int argc = 0;
+		while(1) {
+			while(*p == ' ' || *p == '	' || *p == '\r') p++;
+			if(!*p) break;
+			argv[argc++] = q;
+			int quoted = 0;
+			while(*p && (quoted || (*p != ' ' && *p != '	' && *p != '\r'))) {
+				if(*p == '\"') quoted = !quoted;
+				else *q++ = *p;
+				p++;
+			}
+			if(*p) p++;
+			*q++ = 0;
+		}
+		argv[argc] = NULL;
+		if(!argc || *argv[0] == '#') {
+			free(argv);
+			continue;
+		}
+		int i;
+		for(i = 0; i < argc; i++) argv[i] = xstrdup(argv[i]);
+		char name[32];
+		snprintf(name, sizeof name, "line %u", line_number);
+		add_command_line(xstrdup(name), argc, argv);
+	}
+	free(line);
+	fclose(f);
+	return 0;
+}
+
+#ifndef BENCH_CL2CC
+// Some command lines get modified while they are parsed, so every run of cc2cl gets a copy
+static char **copy_argv(int argc, char **argv) {
+	char **v = xmalloc((argc + 1) * sizeof(char *));
+	int i;
+	for(i = 0; i < argc; i++) v[i] = xstrdup(argv[i]);
+	v[argc] = NULL;
+	return v;
+}
+
+static void free_argv_copy(int argc, char **v) {
+	while(argc--) free(v[argc]);
+	free(v);
+}
+#endif
+
+struct result {
+	unsigned long int runs;
+	uint64_t time;
+	unsigned long int allocations;
+};
+
+static void print_result(const char *name, int argc, const struct result *result) {
+	int args = argc - 1;
+	printf("%-20s %7d %8lu %10.1f %12.3f %12.1f\n", name, args, result->runs,
+		args ? (double)result->time / result->runs / args : 0.0,
+		(double)result->time / result->runs / 1000,
+		(double)result->allocations / result->runs);
+}
+
+#ifdef BENCH_CL2CC
+// add_arg() gets the arguments cl2cc translated, which look much like these
+static int run_add_arg(const struct command_line *command_line, struct result *result) {
+	int i;
+	uint64_t start_time = now_ns();
+	allocations = 0;
+	init_command_line();
+	for(i = 1; i < command_line->argc; i++) add_arg(command_line->argv[i]);
+	result->time += now_ns() - start_time;
+	result->allocations += allocations;
+	while(--cc_argc) free(cc_argv[cc_argc]);
+	free(cc_argv);
+	return 0;
+}
+
+static char *response_file_name;
+
+// Writes the arguments one per line, as MSBuild does
+static int write_response_file(const struct command_line *command_line) {
+	FILE *f = fopen(response_file_name, "wb");
+	if(!f) {
+		perror(response_file_name);
+		return -1;
+	}
+	int i;
+	for(i = 1; i < command_line->argc; i++) {
+		const char *s = command_line->argv[i];
+		if(!strpbrk(s, " 	\"")) {
+			fprintf(f, "%s\r\n", s);
+			continue;
+		}
+		putc('\"', f);
+		while(1) {
+			size_t backslashes = strspn(s, "\\");
+			s += backslashes;
+			if(!*s || *s == '\"') backslashes *= 2;
+			while(backslashes--) putc('\\', f);
+			if(!*s) break;
+			if(*s == '\"') putc('\\', f);
+			putc(*s++, f);
+		}
+		fputs("\"\r\n", f);
+	}
+	if(fclose(f) == EOF) {
+		perror(response_file_name);
+		return -1;
+	}
+	return 0;
+}
+
+static int run_respfile_expand(const struct command_line *command_line, struct result *result) {
+	if(!result->runs && write_response_file(command_line) < 0) return -1;
+	char option[1 + strlen(response_file_name) + 1];
+	char *argv[] = { "cl2cc", option, NULL };
+	int argc = 2;
+	sprintf(option, "@%s", response_file_name);
+	uint64_t start_time = now_ns();
+	allocations = 0;
+	char **v = respfile_expand(&argc, argv);
+	result->time += now_ns() - start_time;
+	result->allocations += allocations;
+	if(!v) return -1;
+	if(argc != command_line->argc) {
+		fprintf(stderr, "%s: expanded to %d arguments instead of %d\n", command_line->name, argc - 1, command_line->argc - 1);
+		return -1;
+	}
+	free(v);
+	return 0;
+}
+#else
+static int cl_started;
+
+int benchmark_start_cl() {
+	cl_started = 1;
+	free_argv();
+	return 0;
+}
+
+static void free_search_paths(struct search_path_list *list) {
+	unsigned int i;
+	for(i = 0; i < list->count; i++) {
+		if(list->paths[i].windows_path != list->paths[i].path) free((char *)list->paths[i].windows_path);
+	}
+	free(list->paths);
+	list->paths = NULL;
+	list->count = 0;
+}
+
+// Puts cc2cl back as a new process would find it
+static void reset_cc2cl() {
+	unsigned int i;
+	for(i = 0; i < object_names_count; i++) free(object_names[i]);
+	free(object_names);
+	object_names = NULL;
+	object_names_count = 0;
+	free(input_file_names);
+	input_file_names = NULL;
+	input_file_names_count = 0;
+	typed_input_files = 0;
+	free_search_paths(&include_paths);
+	free_search_paths(&library_paths);
+	free(libs);
+	libs = NULL;
+	libs_count = 0;
+	free(link_options);
+	link_options = NULL;
+	link_options_count = 0;
+	free(resolved_libs);
+	resolved_libs = NULL;
+	free(temp_output);
+	temp_output = NULL;
+	free(temp_object_directory);
+	temp_object_directory = NULL;
+	free(import_library);
+	import_library = NULL;
+	target.name = NULL;
+	target.type = 0;
+	first_input_file = NULL;
+	multiple_input_files = 0;
+	no_static_link = 1;
+	reproducible = 0;
+	lto_jobs = 0;
+	pipe_mode = 0;
+	last_language = NULL;
+	last_language_unused = 0;
+	input_file_argv_index = 0;
+	// add_search_paths_to_argv() puts the -L directories in front of LIB
+	setenv("INCLUDE", "C:\\Program Files\\Microsoft Visual Studio\\VC\\include", 1);
+	setenv("LIB", "C:\\Program Files\\Microsoft Visual Studio\\VC\\lib", 1);
+}
+
+static int run_main(const struct command_line *command_line, struct result *result) {
+	char **argv = copy_argv(command_line->argc, command_line->argv);
+	reset_cc2cl();
+	cl_started = 0;
+	uint64_t start_time = now_ns();
+	allocations = 0;
+	int r = wrapper_main(command_line->argc, argv);
+	result->time += now_ns() - start_time;
+	result->allocations += allocations;
+	free_argv_copy(command_line->argc, argv);
+	if(!cl_started || r) {
+		fprintf(stderr, "%s: cc2cl ended with status %d before running cl\n", command_line->name, r);
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+static void run(const char *title, int (*f)(const struct command_line *, struct result *)) {
+	unsigned int i;
+	printf("%s\n%-20s %7s %8s %10s %12s %12s\n", title, "command line", "args", "runs", "ns/arg", "us/run", "allocs/run");
+	for(i = 0; i < corpus_count; i++) {
+		struct result result = { 0, 0, 0 };
+		uint64_t start_time = now_ns();
+		do {
+			if(f(corpus + i, &result) < 0) break;
+			result.runs++;
+		} while((result.runs < MIN_RUNS || now_ns() - start_time < MIN_TIME) && result.runs < MAX_RUNS);
+		if(result.runs) print_result(corpus[i].name, corpus[i].argc, &result);
+	}
+}
+
+int main(int argc, char **argv) {
+	int i;
+	for(i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "-f") == 0 && argv[i + 1]) {
+			if(load_corpus(argv[++i]) < 0) return 1;
+		} else {
+			fprintf(stderr, "Usage: %s [-f <command lines file>]...\n", argv[0]);
+			return -1;
+		}
+	}
+	generate_command_line("compile-10", 10, 0);
+	generate_command_line("compile-100", 100, 0);
+	generate_command_line("compile-1000", 1000, 0);
+	generate_command_line("link-1000", 1000, 1);
+	generate_command_line("link-10000", 10000, 1);
+
+#ifdef BENCH_CL2CC
+	run("cl2cc add_arg()", run_add_arg);
+	char name[32];
+#ifdef _WIN32
+	sprintf(name, "argbench-%lu.rsp", (unsigned long int)GetCurrentProcessId());
+#else
+	sprintf(name, "argbench-%lu.rsp", (unsigned long int)getpid());
+#endif
+	response_file_name = name;
+	run("cl2cc respfile_expand()", run_respfile_expand);
+	remove(response_file_name);
+#else
+	// Only the translation is timed; nothing may be recorded or throttled
+	static const char *names[] = { "BUILD_STATS_FILE", "BUILD_RECORD_FILE", "CC2CL_SNAPSHOT", "CC2CL_WORKERS", "MAKEFLAGS" };
+	for(i = 0; i < sizeof names / sizeof *names; i++) unsetenv(names[i]);
+	run("cc2cl main()", run_main);
+#endif
+	return 0;
+}
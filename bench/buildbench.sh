@@ -0,0 +1,118 @@
+#!/bin/sh
+#	buildbench
+#	Copyright 2015 libdll.so
+#
+#	This program is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation; either version 2 of the License, or (at your option) any later version.
+#
+#	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+#	Builds a generated project of <units> sources and one link through cc2cl
+#	with make at every -j level, with bench/stubcl.c as cl, and prints for
+#	each level the compiles per second, the mean wrapper overhead from
+#	BUILD_STATS_FILE, and the latency of the wrapper invocations from
+#	BUILD_RECORD_FILE.  It needs only a C compiler and make.
+
+set -e
+
+usage() {
+	echo "Usage: $0 [-n <units>] [-j \"<jobs> ...\"] [-m sleep|burn|write] [-t <ms>] [-s <bytes>] [-d <directory>]" >&2
+	echo "	-n	Sources in the project, default 256" >&2
+	echo "	-j	The -j levels, default powers of 2 up to the number of processors, at most 128" >&2
+	echo "	-m	What the stub cl does, see bench/stubcl.c, default sleep" >&2
+	echo "	-t	How long every stub cl takes in milliseconds, default 10" >&2
+	echo "	-s	Size of every object it writes, default 4096" >&2
+	echo "	-d	Work in <directory> and keep it, instead of a temporary one" >&2
+	exit 255
+}
+
+units=256
+levels=
+mode=sleep
+time=10
+size=4096
+directory=
+while getopts n:j:m:t:s:d: option; do
+	case $option in
+		n) units=$OPTARG ;;
+		j) levels=$OPTARG ;;
+		m) mode=$OPTARG ;;
+		t) time=$OPTARG ;;
+		s) size=$OPTARG ;;
+		d) directory=$OPTARG ;;
+		*) usage ;;
+	esac
+done
+[ $OPTIND -gt $# ] || usage
+
+top=$(cd "$(dirname "$0")/.." && pwd)
+if [ -z "$levels" ]; then
+	processors=$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1)
+	[ "$processors" -le 128 ] || processors=128
+	j=1
+	while [ $j -lt "$processors" ]; do
+		levels="$levels $j"
+		j=$((j * 2))
+	done
+	levels="$levels $processors"
+fi
+if [ -n "$directory" ]; then
+	mkdir -p "$directory"
+	work=$(cd "$directory" && pwd)
+else
+	work=$(mktemp -d "${TMPDIR:-/tmp}/buildbench.XXXXXX")
+	trap 'rm -rf "$work"' EXIT
+fi
+
+CC=${CC:-cc}
+$CC -O2 -o "$work/cc2cl" "$top/cc2cl.c"
+$CC -O2 -o "$work/stubcl" "$top/bench/stubcl.c"
+$CC -O2 -o "$work/replay" "$top/replay.c"
+
+mkdir -p "$work/project"
+i=0
+while [ $i -lt "$units" ]; do
+	printf 'int function%d(int x) {\n\treturn x * %d;\n}\n' $i $i > "$work/project/unit$i.c"
+	i=$((i + 1))
+done
+printf 'int main() {\n\treturn 0;\n}\n' > "$work/project/main.c"
+cat > "$work/project/Makefile" <<'EOF'
+OBJECTS = $(patsubst %.c,%.o,$(wildcard *.c))
+
+program.exe: $(OBJECTS)
+	$(CC) -o $@ $(OBJECTS)
+
+%.o: %.c
+	$(CC) -c -O2 -Wall -DNDEBUG -I. -o $@ $<
+
+clean:
+	rm -f *.o program.exe
+EOF
+
+export CL_LOCATION="$work/stubcl" STUBCL_MODE=$mode STUBCL_TIME=$time STUBCL_SIZE=$size
+export INCLUDE='C:\include' LIB='C:\lib'
+export BUILD_STATS_FILE="$work/stats" BUILD_RECORD_FILE="$work/record"
+unset MAKEFLAGS MFLAGS CL_THROTTLE CC2CL_WORKERS CC2CL_SNAPSHOT
+
+now() {
+	date +%s%N
+}
+
+echo "$units units and a link, stub cl: $mode $time ms, $size bytes"
+printf '%6s %10s %12s %14s %10s %10s %10s\n' jobs "wall s" compiles/s "overhead ms" "p50 ms" "p99 ms" "max ms"
+for j in $levels; do
+	make -s -C "$work/project" clean
+	rm -f "$BUILD_STATS_FILE" "$BUILD_RECORD_FILE"
+	start=$(now)
+	make -s -C "$work/project" -j"$j" CC="$work/cc2cl"
+	end=$(now)
+	overhead=$("$work/cc2cl" --stats | sed -n 's/^wrapper overhead: .*, \([0-9.]*\) ms mean$/\1/p')
+	"$work/replay" -l "$BUILD_RECORD_FILE" | sed -n 's/^cc2cl, status [0-9-]*, \([0-9.]*\) ms .*/\1/p' | sort -n |
+	awk -v j="$j" -v ns=$((end - start)) -v overhead="$overhead" '
+		{ t[NR] = $1 }
+		END {
+			s = ns / 1e9
+			p50 = t[int((NR - 1) * 0.50) + 1]
+			p99 = t[int((NR - 1) * 0.99) + 1]
+			printf "%6d %10.3f %12.1f %14s %10.3f %10.3f %10.3f\n", j, s, NR / s, overhead, p50, p99, t[NR]
+		}'
+done
@@ -0,0 +1,154 @@
+/*	stubcl
+	Copyright 2015 libdll.so
+
+	This program is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation; either version 2 of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+*/
+
+/*	Stands in for cl as CL_LOCATION, so builds through cc2cl can be timed
+	without a Windows toolchain.  It takes as long as STUBCL_TIME
+	milliseconds, default 0, the way STUBCL_MODE says:
+
+		sleep	Sleeps, like a compiler waiting on the disk or network
+		burn	Keeps a processor busy, like a real compile
+		write	Takes no time, only writes the output
+
+	and then writes STUBCL_SIZE bytes, default 4096, to every file it would
+	produce: the -Fo and -Fe files, or <source>.obj for each source with
+	-c and no -Fo file.  With -E it copies the sources to standard output.
+*/
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+static const char *program_name;
+static char *buffer;
+static size_t size = 4096;
+
+static int write_output(const char *file) {
+	int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(fd == -1) {
+		fprintf(stderr, "%s: cannot create %s, %s\n", program_name, file, strerror(errno));
+		return -1;
+	}
+	size_t written = 0;
+	while(written < size) {
+		ssize_t s = write(fd, buffer + written, size - written);
+		if(s < 0) {
+			if(errno == EINTR) continue;
+			fprintf(stderr, "%s: cannot write %s, %s\n", program_name, file, strerror(errno));
+			close(fd);
+			return -1;
+		}
+		written += s;
+	}
+	return close(fd);
+}
+
+static int copy_source(const char *file) {
+	char data[65536];
+	int fd = open(file, O_RDONLY);
+	if(fd == -1) {
+		fprintf(stderr, "%s: cannot open source file: '%s', %s\n", program_name, file, strerror(errno));
+		return -1;
+	}
+	ssize_t s;
+	while((s = read(fd, data, sizeof data)) > 0) fwrite(data, 1, s, stdout);
+	close(fd);
+	return s < 0 ? -1 : 0;
+}
+
+// <source> without its extension and directory, plus .obj
+static int write_object_for(const char *source) {
+	const char *name = strrchr(source, '/');
+	const char *backslash = strrchr(name ? name : source, '\\');
+	if(backslash) name = backslash;
+	name = name ? name + 1 : source;
+	const char *dot = strrchr(name, '.');
+	size_t len = dot ? dot - name : strlen(name);
+	char object[len + 4 + 1];
+	memcpy(object, name, len);
+	strcpy(object + len, ".obj");
+	return write_output(object);
+}
+
+static void take_time(const char *mode, long int ms) {
+	struct timespec ts = { ms / 1000, ms % 1000 * 1000000 };
+	if(strcmp(mode, "sleep") == 0) {
+		while(nanosleep(&ts, &ts) < 0 && errno == EINTR);
+	} else if(strcmp(mode, "burn") == 0) {
+		struct timespec now, end;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		end.tv_sec += ts.tv_sec;
+		if((end.tv_nsec += ts.tv_nsec) >= 1000000000) {
+			end.tv_sec++;
+			end.tv_nsec -= 1000000000;
+		}
+		volatile unsigned long int n = 0;
+		do {
+			unsigned int i;
+			for(i = 0; i < 10000; i++) n = n * 6364136223846793005UL + 1442695040888963407UL;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+		} while(now.tv_sec < end.tv_sec || (now.tv_sec == end.tv_sec && now.tv_nsec < end.tv_nsec));
+	}
+}
+
+int main(int argc, char **argv) {
+	const char *mode = getenv("STUBCL_MODE");
+	const char *time_string = getenv("STUBCL_TIME");
+	const char *size_string = getenv("STUBCL_SIZE");
+	const char *object = NULL, *executable = NULL;
+	int compile_only = 0, preprocess = 0, r = 0;
+	char **v = argv, **sources = argv;
+	program_name = argv[0];
+	if(!mode) mode = "sleep";
+	if(strcmp(mode, "sleep") && strcmp(mode, "burn") && strcmp(mode, "write")) {
+		fprintf(stderr, "%s: unknown STUBCL_MODE %s\n", argv[0], mode);
+		return 2;
+	}
+	if(size_string) size = strtoul(size_string, NULL, 0);
+	if(!(buffer = malloc(size ? size : 1))) {
+		perror(NULL);
+		return 2;
+	}
+	memset(buffer, 0x90, size);
+
+	// Only the options that name files matter
+	while(*++v) {
+		const char *arg = *v;
+		if(*arg != '-' && *arg != '/') *sources++ = *v;
+		else if(strncmp(arg + 1, "Tc", 2) == 0 || strncmp(arg + 1, "Tp", 2) == 0) *sources++ = *v + 3;
+		else if(strncmp(arg + 1, "Fo", 2) == 0) {
+			size_t len = strlen(arg);
+			// A directory, in which cl would name the objects after the sources
+			if(arg[len - 1] != '\\' && arg[len - 1] != '/') object = arg + 3;
+		} else if(strncmp(arg + 1, "Fe", 2) == 0) executable = arg + 3;
+		else if(strcmp(arg + 1, "c") == 0) compile_only = 1;
+		else if(strcmp(arg + 1, "E") == 0 || strcmp(arg + 1, "EP") == 0) preprocess = 1;
+	}
+	*sources = NULL;
+	if(sources == argv) {
+		fprintf(stderr, "%s: no source files\n", argv[0]);
+		return 2;
+	}
+
+	take_time(mode, time_string ? atol(time_string) : 0);
+	if(preprocess) {
+		for(sources = argv; *sources; sources++) if(copy_source(*sources) < 0) r = 2;
+		return r;
+	}
+	if(compile_only && !object) {
+		for(sources = argv; *sources; sources++) if(write_object_for(*sources) < 0) r = 2;
+		return r;
+	}
+	if(object && write_output(object) < 0) r = 2;
+	if(!compile_only && write_output(executable ? executable : "a.exe") < 0) r = 2;
+	return r;
+}
@@ -10,7 +10,10 @@
 #include <windows.h>
 #else
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <dirent.h>
 #ifdef __INTERIX
 #include <interix/interix.h>
 #endif
@@ -23,6 +26,14 @@
 #include <errno.h>
 #include <ctype.h>
 #include <assert.h>
+#include "stats.h"
+#include "jobserver.h"
+#include "record.h"
+#include "children.h"
+#include "linkcache.h"
+#ifndef _WIN32
+#include "dist.h"
+#endif
 
 #ifndef DEFAULT_OUTPUT_FILENAME
 #define DEFAULT_OUTPUT_FILENAME "a.exe"
@@ -133,15 +144,57 @@ static struct {
 	unsigned int type;
 } target;
 
+static char *temp_output;		// What cl writes, renamed to target.name at the end
+static char *temp_object_directory;
+static char *import_library;		// In temp_object_directory, moved next to the target if the link writes one
+
+static const char *first_input_file;
+static int multiple_input_files = 0;
+static char **object_names;
+static unsigned int object_names_count;
+static const char **input_file_names;	// As given, for linkcache.h
+static unsigned int input_file_names_count;
+static int typed_input_files;		// Whether -x applied to any
+
+// For '-c' with multiple files, cl names the objects <name>.obj in the current directory
+static int rename_objects() {
+	int r = 0;
+	unsigned int i;
+	for(i = 0; i < object_names_count; i++) {
+		size_t len = strlen(object_names[i]);
+		char obj[len + 4 + 1], o[len + 2 + 1];
+		memcpy(obj, object_names[i], len);
+		strcpy(obj + len, ".obj");
+		memcpy(o, object_names[i], len);
+		strcpy(o + len, ".o");
+		if(rename(obj, o) < 0) {
+			perror(obj);
+			r = 1;
+		}
+	}
+	return r;
+}
+
+static uint64_t hash_string(const char *s) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	while(*s) h = (h ^ (unsigned char)*s++) * 0x100000001b3ULL;
+	return h;
+}
+
 #ifdef _WIN32
-static void add_to_path(const char *p) {
 #define PATHS_SEPARATOR ';'
+#else
+#define PATHS_SEPARATOR ':'
+#endif
+
+#ifdef _WIN32
+static void add_to_path(const char *p) {
 	static char *lpath;
 	const char *path = getenv("PATH");
 	if(!path) path = "";
 	size_t old_path_len = strlen(path);
 	size_t p_len = strlen(p);
-	lpath = realloc(lpath, old_path_len + p_len + 2);
+	lpath = realloc(lpath, 5 + p_len + 1 + old_path_len + 1);
 	if(!lpath) {
 		perror(NULL);
 		abort();
@@ -155,6 +208,19 @@ static void add_to_path(const char *p) {
 	putenv(lpath);
 }
 
+static void add_vs_bin_to_path() {
+	const char *vs_path = getenv("VS_PATH");
+	if(!vs_path) vs_path = getenv("VSINSTALLDIR");
+	if(vs_path) {
+		size_t len = strlen(vs_path);
+		if(vs_path[len - 1] == '/' || vs_path[len - 1] == '\\') len--; 
+		char buffer[len + 8];
+		memcpy(buffer, vs_path, len);
+		strcpy(buffer + len, "/VC/bin");
+		add_to_path(buffer);
+	}
+}
+
 static int argv_to_command_line(char **argv, char *command_line, size_t buffer_size) {
 	size_t command_line_len = 0, len;
 	char *p;
@@ -171,108 +237,902 @@ static int argv_to_command_line(char **argv, char *command_line, size_t buffer_s
 }
 #endif
 
-// Call only once!
-int start_cl() {
+#define SNAPSHOT_MAGIC 0x31534e53		// "SNS1"
+
+struct snapshot_header {
+	uint32_t magic;
+	uint32_t size;
+	uint64_t key;
+	// Offsets of the strings from the start of the file, 0 if unset
+	uint32_t include;
+	uint32_t lib;
+	uint32_t path;
+	uint32_t compiler;
+};
+
+static struct {
+	const char *include;
+	const char *lib;
+	const char *path;
+	const char *compiler;
+} snapshot;
+static int snapshot_loaded;
+static uint64_t snapshot_key;
+
+// Hashes everything the toolchain discovery depends on
+static uint64_t get_snapshot_key() {
+	static const char *names[] = { "VS_PATH", "VSINSTALLDIR", "INCLUDE", "LIB", "PATH", "CL_LOCATION" };
+	uint64_t h = 0xcbf29ce484222325ULL;
+	int i;
+	for(i = 0; i < sizeof names / sizeof(char *); i++) {
+		const char *value = getenv(names[i]);
+		h = (h ^ (value ? hash_string(value) : 0)) * 0x100000001b3ULL;
+	}
+	return h;
+}
+
+// The mapping is kept for the life of the process
+static int load_snapshot() {
+	const char *file = getenv("CC2CL_SNAPSHOT");
+	if(!file || !*file) return -1;
+	const char *p;
+	size_t size;
+#ifdef _WIN32
+	void *fh = CreateFileA(file, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(fh == INVALID_HANDLE_VALUE) return -1;
+	size = GetFileSize(fh, NULL);
+	void *mh = size == INVALID_FILE_SIZE || size < sizeof(struct snapshot_header) ? NULL : CreateFileMappingA(fh, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(fh);
+	if(!mh) return -1;
+	p = MapViewOfFile(mh, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mh);
+	if(!p) return -1;
+#else
+	int fd = open(file, O_RDONLY);
+	if(fd == -1) return -1;
+	struct stat st;
+	if(fstat(fd, &st) < 0 || st.st_size < sizeof(struct snapshot_header)) {
+		close(fd);
+		return -1;
+	}
+	size = st.st_size;
+	p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED) return -1;
+#endif
+	const struct snapshot_header *header = (const struct snapshot_header *)p;
+	if(header->magic != SNAPSHOT_MAGIC || header->size != size || header->key != snapshot_key || p[size - 1]) return -1;
+	if(header->include >= size || header->lib >= size || header->path >= size || header->compiler >= size) return -1;
+	snapshot.include = header->include ? p + header->include : NULL;
+	snapshot.lib = header->lib ? p + header->lib : NULL;
+	snapshot.path = header->path ? p + header->path : NULL;
+	snapshot.compiler = header->compiler ? p + header->compiler : NULL;
+	snapshot_loaded = 1;
+	return 0;
+}
+
+static const char *find_compiler() {
 	const char *compiler = getenv("CL_LOCATION");
+	if(compiler) return compiler;
+	static char buffer[PATH_MAX + 1];
+	const char *path = getenv("PATH");
+	size_t name_len = strlen(cl_argv[0]);
+	while(path && *path) {
+		size_t len = 0;
+		while(path[len] && path[len] != PATHS_SEPARATOR) len++;
+		if(len && len + 1 + name_len < sizeof buffer) {
+			memcpy(buffer, path, len);
+			buffer[len] = '/';
+			strcpy(buffer + len + 1, cl_argv[0]);
 #ifdef _WIN32
-	const char *vs_path = getenv("VS_PATH");
-	if(!vs_path) vs_path = getenv("VSINSTALLDIR");
-	if(vs_path) {
-		size_t len = strlen(vs_path);
-		if(vs_path[len - 1] == '/' || vs_path[len - 1] == '\\') len--; 
-		char buffer[len + 8];
-		memcpy(buffer, vs_path, len);
-		strcpy(buffer + len, "/VC/bin");
-		add_to_path(buffer);
+			if(access(buffer, F_OK) == 0) return buffer;
+#else
+			if(access(buffer, X_OK) == 0) return buffer;
+#endif
+		}
+		path += len;
+		if(*path) path++;
 	}
-	char command_line[PATH_MAX * 2 + 1];
-	argv_to_command_line(cl_argv, command_line, sizeof command_line);
-	STARTUPINFOA si = { .cb = sizeof(STARTUPINFOA) };
-	if(target.type == PREPROCESSED_SOURCE && target.name) {
-		SECURITY_ATTRIBUTES security_attr = {
-			.nLength = sizeof(SECURITY_ATTRIBUTES),
-			.lpSecurityDescriptor = NULL,
-			.bInheritHandle = 1
-		};
-		void *fh = CreateFileA(target.name, GENERIC_WRITE, FILE_SHARE_READ, &security_attr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-		if(fh == INVALID_HANDLE_VALUE) {
-			fprintf(stderr, "error: opening output file %s: CreateFileA failed, error %lu\n", target.name, GetLastError());
-			return 1;
-		}
-		si.hStdOutput = fh;
-		si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
-		si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
-		si.dwFlags |= STARTF_USESTDHANDLES;
-	}
-	PROCESS_INFORMATION pi;
-	while(!CreateProcessA(compiler, command_line, NULL, NULL, 1, 0, NULL, NULL, &si, &pi)) {
-		if(compiler) {
-			compiler = NULL;
-			continue;
+	return NULL;
+}
+
+void write_snapshot(const char *name) {
+	const char *file = getenv("CC2CL_SNAPSHOT");
+	if(!file || !*file) {
+		fprintf(stderr, "%s: error: CC2CL_SNAPSHOT is not set\n", name);
+		exit(1);
+	}
+#ifdef _WIN32
+	add_vs_bin_to_path();
+#endif
+	const char *values[4] = { getenv("INCLUDE"), getenv("LIB"), getenv("PATH"), find_compiler() };
+	size_t size = sizeof(struct snapshot_header);
+	int i;
+	for(i = 0; i < 4; i++) if(values[i]) size += strlen(values[i]) + 1;
+	char buffer[size];
+	struct snapshot_header *header = (struct snapshot_header *)buffer;
+	uint32_t *offsets = &header->include;
+	memset(header, 0, sizeof *header);
+	header->magic = SNAPSHOT_MAGIC;
+	header->size = size;
+	header->key = snapshot_key;
+	size = sizeof *header;
+	for(i = 0; i < 4; i++) {
+		if(!values[i]) continue;
+		offsets[i] = size;
+		strcpy(buffer + size, values[i]);
+		size += strlen(values[i]) + 1;
+	}
+	// Written aside and renamed, so concurrent invocations never see a partial file
+	char temp[strlen(file) + 1 + 10 + 1];
+	sprintf(temp, "%s.%u", file, (unsigned int)getpid());
+	FILE *f = fopen(temp, "wb");
+	if(!f || fwrite(buffer, size, 1, f) != 1 || fclose(f) == EOF) {
+		perror(temp);
+		exit(1);
+	}
+#ifdef _WIN32
+	if(!MoveFileExA(temp, file, MOVEFILE_REPLACE_EXISTING)) {
+		fprintf(stderr, "%s: error: cannot rename %s to %s, error %lu\n", name, temp, file, GetLastError());
+#else
+	if(rename(temp, file) < 0) {
+		perror(file);
+#endif
+		unlink(temp);
+		exit(1);
+	}
+	if(!values[3]) fprintf(stderr, "%s: warning: %s not found in PATH\n", name, cl_argv[0]);
+	exit(0);
+}
+
+#ifndef _WIN32
+#define THROTTLE_DEFAULT_LOCK_FILE "/tmp/cc2cl-throttle"
+#define THROTTLE_HISTORY_SLOTS 8192
+
+static int throttle_fd = -1;
+static uint64_t *throttle_history;
+static char *throttle_source;
+
+// Each slot holds the top 44 bits of the source path hash and the peak memory use in MiB
+static uint64_t *map_throttle_history() {
+	const char *file = getenv("CL_THROTTLE_HISTORY");
+	if(!file || !*file) return NULL;
+	int fd = open(file, O_RDWR | O_CREAT | O_NOFOLLOW, 0666);
+	if(fd == -1) return NULL;
+	struct stat st;
+	if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || (st.st_size < THROTTLE_HISTORY_SLOTS * sizeof(uint64_t) && ftruncate(fd, THROTTLE_HISTORY_SLOTS * sizeof(uint64_t)) < 0)) {
+		close(fd);
+		return NULL;
+	}
+	uint64_t *history = mmap(NULL, THROTTLE_HISTORY_SLOTS * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	return history == MAP_FAILED ? NULL : history;
+}
+
+// In KiB; 0 if unknown
+static long int get_memory_estimate(const char *source) {
+	if(!throttle_history) return 0;
+	uint64_t h = hash_string(source);
+	uint64_t e = __atomic_load_n(throttle_history + h % THROTTLE_HISTORY_SLOTS, __ATOMIC_RELAXED);
+	if(e >> 20 != h >> 44) return 0;
+	return (e & 0xfffff) * 1024;
+}
+
+static void save_memory_estimate(const char *source, long int kib) {
+	if(!throttle_history) return;
+	uint64_t h = hash_string(source);
+	uint64_t mib = (kib + 1023) / 1024;
+	if(mib > 0xfffff) mib = 0xfffff;
+	__atomic_store_n(throttle_history + h % THROTTLE_HISTORY_SLOTS, h >> 44 << 20 | mib, __ATOMIC_RELAXED);
+}
+
+// In KiB; -1 if unknown
+static long int get_available_memory() {
+	FILE *f = fopen("/proc/meminfo", "r");
+	if(!f) return -1;
+	char line[128];
+	long int kib = -1;
+	while(fgets(line, sizeof line, f)) {
+		if(sscanf(line, "MemAvailable: %ld kB", &kib) == 1) break;
+	}
+	fclose(f);
+	return kib;
+}
+
+/*	The slots are the first CL_THROTTLE bytes of a host-wide lock file,
+	CL_THROTTLE_FILE or /tmp/cc2cl-throttle, taken with record locks, which the kernel drops when the process ends
+	however it ends, so a killed wrapper never keeps one.  Every invocation
+	counts the slots of its own CL_THROTTLE.  Holding a slot, it then waits
+	for enough available memory for this source and, if CL_THROTTLE_LOAD is
+	set, for the load average to drop below it; a compile that would run
+	alone is always admitted.
+*/
+static int throttle_lock(unsigned int slot, int command) {
+	struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = slot, .l_len = 1 };
+	return fcntl(throttle_fd, command, &lock);
+}
+
+// How many of the first slots are held by other processes
+static unsigned int throttle_count_busy(unsigned int slots) {
+	unsigned int busy = 0, i;
+	for(i = 0; i < slots; i++) {
+		struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = i, .l_len = 1 };
+		if(fcntl(throttle_fd, F_GETLK, &lock) == 0 && lock.l_type != F_UNLCK) busy++;
+	}
+	return busy;
+}
+
+static void throttle_acquire(const char *source) {
+	const char *s = getenv("CL_THROTTLE");
+	if(!s || !*s) return;
+	int slots = atoi(s);
+	if(slots <= 0) slots = sysconf(_SC_NPROCESSORS_ONLN);
+	if(slots <= 0) slots = 1;
+	s = getenv("CL_THROTTLE_LOAD");
+	double max_load = s ? atof(s) : 0;
+
+	const char *file = getenv("CL_THROTTLE_FILE");
+	if(!file || !*file) file = THROTTLE_DEFAULT_LOCK_FILE;
+	throttle_fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0666);
+	struct stat st;
+	if(throttle_fd == -1 || fstat(throttle_fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "warning: cannot use %s as the throttle lock file, %s\n", file, throttle_fd == -1 ? strerror(errno) : "not a regular file");
+		if(throttle_fd != -1) close(throttle_fd);
+		throttle_fd = -1;
+		return;
+	}
+	// For the other users of the host, whatever the umask; only a file of our own is changed
+	if(st.st_uid == getuid() && (st.st_mode & 0777) != 0666) fchmod(throttle_fd, 0666);
+	throttle_history = map_throttle_history();
+	long int need = 0;
+	if(source && throttle_history) {
+		char path[PATH_MAX];
+		throttle_source = strdup(realpath(source, path) ? path : source);
+		if(throttle_source) need = get_memory_estimate(throttle_source);
+	}
+	unsigned int delay = 10, first = getpid() % slots, i;
+	while(1) {
+		// Starting from a slot picked by the process id, so waiting invocations spread out
+		for(i = 0; i < slots; i++) {
+			unsigned int slot = (first + i) % slots;
+			if(throttle_lock(slot, F_SETLK) < 0) {
+				if(errno == EACCES || errno == EAGAIN || errno == EINTR) continue;
+				fprintf(stderr, "warning: cannot lock %s, %s\n", file, strerror(errno));
+				close(throttle_fd);
+				throttle_fd = -1;
+				return;
+			}
+			double load;
+			if(throttle_count_busy(slots) == 0) return;
+			long int available = need ? get_available_memory() : -1;
+			if((available < 0 || available >= need) &&
+			(max_load <= 0 || getloadavg(&load, 1) < 1 || load < max_load)) return;
+			throttle_lock(slot, F_UNLCK);
+			break;
 		}
-		fprintf(stderr, "CreateProcessA failed, error %lu\n", GetLastError());
-		return 127;
+		usleep(delay * 1000);
+		if(delay < 500) delay *= 2;
 	}
-	unsigned long int r;
-	WaitForSingleObject(pi.hProcess, INFINITE);
-	GetExitCodeProcess(pi.hProcess, &r);
+}
+
+static void throttle_release() {
+	if(throttle_fd == -1) return;
+	// Closing the file drops the lock
+	close(throttle_fd);
+	throttle_fd = -1;
+	struct rusage ru;
+	if(throttle_source && getrusage(RUSAGE_CHILDREN, &ru) == 0 && ru.ru_maxrss > 0) {
+#ifdef __APPLE__
+		ru.ru_maxrss /= 1024;
+#endif
+		save_memory_estimate(throttle_source, ru.ru_maxrss);
+	}
+}
+#endif
+
+static char *get_temp_name(const char *file, const char *suffix) {
+	char *r = malloc(strlen(file) + 7 + 10 + strlen(suffix) + 1);
+	if(!r) {
+		perror(NULL);
+		abort();
+	}
+	sprintf(r, "%s.cc2cl-%u%s", file, (unsigned int)getpid(), suffix);
+	return r;
+}
+
+static int replace_file(const char *from, const char *to) {
+#ifdef _WIN32
+	if(!MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING)) {
+		fprintf(stderr, "error: cannot rename %s to %s, error %lu\n", from, to, GetLastError());
+		return -1;
+	}
+#else
+	if(rename(from, to) < 0) {
+		fprintf(stderr, "error: cannot rename %s to %s, %s\n", from, to, strerror(errno));
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+static void remove_temp_objects() {
+	size_t len = strlen(temp_object_directory);
+	unsigned int i;
+	for(i = 0; i < object_names_count; i++) {
+		char obj[len + 1 + strlen(object_names[i]) + 4 + 1];
+		sprintf(obj, "%s/%s.obj", temp_object_directory, object_names[i]);
+		unlink(obj);
+	}
+#ifdef _WIN32
+	RemoveDirectoryA(temp_object_directory);
+#else
+	rmdir(temp_object_directory);
+#endif
+}
+
+// The import library and its .exp are only written when the target exports something
+static void move_import_library(int r) {
+	size_t temp_len = strlen(import_library) - 4, len = strlen(target.name);
+	int n = get_last_dot(target.name, len);
+	if(n >= 0) len = n;
+	char from[temp_len + 4 + 1], to[len + 4 + 1];
+	const char *suffixes[] = { ".lib", ".exp" };
+	unsigned int i;
+	for(i = 0; i < 2; i++) {
+		sprintf(from, "%.*s%s", (int)temp_len, import_library, suffixes[i]);
+		if(access(from, F_OK) < 0) continue;
+		sprintf(to, "%.*s%s", (int)len, target.name, suffixes[i]);
+		if(r || replace_file(from, to) < 0) unlink(from);
+	}
+}
+
+// Moves what cl wrote into place, or removes it if cl failed
+static int finish_output(int r) {
+	if(import_library) move_import_library(r);
+	if(temp_object_directory) remove_temp_objects();
+	if(!temp_output) return r;
+	if(r) {
+		unlink(temp_output);
+		return r;
+	}
+	if(replace_file(temp_output, target.name) < 0) return 1;
+	if(target.type != EXE) return 0;
+	// The PDB and the import library were named by link options; the rest follow the output name
+	size_t temp_len = strlen(temp_output) - 4, len = strlen(target.name);
+	int n = get_last_dot(target.name, len);
+	if(n >= 0) len = n;
+	char from[strlen(temp_output) + 9 + 1], to[strlen(target.name) + 9 + 1];
+	sprintf(from, "%.*s.ilk", (int)temp_len, temp_output);
+	sprintf(to, "%.*s.ilk", (int)len, target.name);
+	rename(from, to);
+	sprintf(from, "%s.manifest", temp_output);
+	sprintf(to, "%s.manifest", target.name);
+	rename(from, to);
+	return 0;
+}
+
+/*	CL_RETRY sets how many times a compile is retried after a failure that
+	is known to be transient: fork running out of processes, or cl
+	reporting one of the PDB server or file locking errors below.  The
+	output of cl is held back while retries are possible, so only the last
+	attempt is shown.  The delay before retry n is picked at random from
+	the upper half of CL_RETRY_DELAY * 2^n milliseconds (default 100),
+	capped at CL_RETRY_MAX_DELAY (default 5000).
+*/
+static unsigned int retry_limit;
+
+static const char *transient_errors[] = {
+	"C1902",	// Program database manager mismatch
+	"C1041",	// Cannot open program database
+	"C1090",	// PDB API call failed
+	"LNK1318",	// Unexpected PDB error
+	"mspdbsrv"
+};
+
+static unsigned int get_retry_limit() {
+	const char *retry = getenv("CL_RETRY");
+	return retry ? atoi(retry) : 0;
+}
+
+static void retry_sleep(unsigned int attempt) {
+	static int seeded;
+	if(!seeded) {
+		srand(getpid() ^ stats_now());
+		seeded = 1;
+	}
+	const char *s = getenv("CL_RETRY_DELAY");
+	unsigned long int delay = s ? strtoul(s, NULL, 0) : 100;
+	s = getenv("CL_RETRY_MAX_DELAY");
+	unsigned long int max_delay = s ? strtoul(s, NULL, 0) : 5000;
+	while(attempt-- && delay < max_delay) delay *= 2;
+	if(delay > max_delay) delay = max_delay;
+	delay = delay / 2 + rand() % (delay / 2 + 1);
+#ifdef _WIN32
+	Sleep(delay);
+#else
+	usleep(delay * 1000);
+#endif
+}
 
+static int is_transient_failure(char *output) {
+	if(!output) return 0;
+	char *line = output;
+	while(*line) {
+		char *end = strchr(line, '\n');
+		if(end) *end = 0;
+		int transient = strstr(line, "C1083") && strstr(line, "Permission denied");
+		unsigned int i;
+		for(i = 0; !transient && i < sizeof transient_errors / sizeof *transient_errors; i++) {
+			transient = strstr(line, transient_errors[i]) != NULL;
+		}
+		if(!end) return transient;
+		*end = '\n';
+		if(transient) return 1;
+		line = end + 1;
+	}
+	return 0;
+}
+
+#ifdef _WIN32
+static void *create_capture_file() {
+	char directory[PATH_MAX + 1], name[PATH_MAX + 1];
+	if(!GetTempPathA(sizeof directory, directory) || !GetTempFileNameA(directory, "cl", 0, name)) return INVALID_HANDLE_VALUE;
+	SECURITY_ATTRIBUTES security_attr = {
+		.nLength = sizeof(SECURITY_ATTRIBUTES),
+		.lpSecurityDescriptor = NULL,
+		.bInheritHandle = 1
+	};
+	return CreateFileA(name, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, &security_attr,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+}
+
+// Returns what was written to the file, NUL terminated, and closes it
+static char *read_capture_file(void *fh) {
+	if(fh == INVALID_HANDLE_VALUE) return NULL;
+	unsigned long int size = GetFileSize(fh, NULL), read_size;
+	char *r = size == INVALID_FILE_SIZE ? NULL : malloc(size + 1);
+	if(r) {
+		SetFilePointer(fh, 0, NULL, FILE_BEGIN);
+		if(!ReadFile(fh, r, size, &read_size, NULL)) read_size = 0;
+		r[read_size] = 0;
+	}
+	CloseHandle(fh);
+	return r;
+}
+
+static void write_captured_output(char *output, void *fh) {
+	if(!output) return;
+	unsigned long int written;
+	WriteFile(fh, output, strlen(output), &written, NULL);
+	free(output);
+}
 #else
+static int create_capture_file() {
+	FILE *f = tmpfile();
+	if(!f) return -1;
+	int fd = dup(fileno(f));
+	fclose(f);
+	return fd;
+}
+
+static char *read_capture_file(int fd) {
+	if(fd == -1) return NULL;
+	struct stat st;
+	char *r = fstat(fd, &st) < 0 ? NULL : malloc(st.st_size + 1);
+	if(r) {
+		ssize_t s = pread(fd, r, st.st_size, 0);
+		r[s < 0 ? 0 : s] = 0;
+	}
+	close(fd);
+	return r;
+}
+
+static void write_captured_output(char *output, int fd) {
+	if(!output) return;
+	size_t len = strlen(output);
+	const char *p = output;
+	while(len) {
+		ssize_t s = write(fd, p, len);
+		if(s < 0) {
+			if(errno == EINTR) continue;
+			break;
+		}
+		p += s;
+		len -= s;
+	}
+	free(output);
+}
+#endif
+
+static int pipe_mode;
+
+void set_pipe() {
+	pipe_mode = 1;
+}
+
+#ifndef _WIN32
+/*	With CC2CL_WORKERS set to a comma separated list of worker addresses
+	(see dist.h), a single source compiled with -c is preprocessed here and
+	compiled by the first worker with a free slot, trying them from one
+	picked by the process id, so parallel invocations spread out.  If no
+	worker is free within CC2CL_WORKER_TIMEOUT milliseconds (default 500)
+	each, or the connection breaks, the source is compiled here as usual.
+*/
+static int input_file_argv_index;
+static struct sigaction sigpipe_action;
+static int sigpipe_ignored;
+
+// Call in the child before exec, so cl doesn't inherit the SIGPIPE ignored for the worker socket
+static void restore_sigpipe() {
+	if(sigpipe_ignored) sigaction(SIGPIPE, &sigpipe_action, NULL);
+}
+
+// Returns 'c' or 'p' as in -Tc and -Tp, 0 if the input is not a source
+static int get_input_language() {
+	const char *input = cl_argv[input_file_argv_index];
+	int i;
+	if(strncmp(input, "-Tc", 3) == 0 || strncmp(input, "-Tp", 3) == 0) return input[2];
+	for(i = 1; i < cl_argc; i++) {
+		if(strcmp(cl_argv[i], "-TC") == 0) return 'c';
+		if(strcmp(cl_argv[i], "-TP") == 0) return 'p';
+	}
+	size_t len = strlen(input);
+	int n = get_last_dot(input, len);
+	if(n < 0) return 0;
+	const char *ext = input + n + 1;
+	if(strcasecmp(ext, "c") == 0) return 'c';
+	if(strcasecmp(ext, "cpp") == 0 || strcasecmp(ext, "cxx") == 0 || strcasecmp(ext, "cc") == 0 || strcasecmp(ext, "c++") == 0) return 'p';
+	return 0;
+}
+
+// Options that only matter to the preprocessor, or name local files
+static int is_local_option(const char *arg) {
+	static const char *prefixes[] = { "-I", "-D", "-U", "-FI", "-Fd", "-Fo", "-MP", "-T" };
+	unsigned int i;
+	if(strcmp(arg, "-X") == 0 || strcmp(arg, "-u") == 0) return 1;
+	for(i = 0; i < sizeof prefixes / sizeof *prefixes; i++) {
+		if(strncmp(arg, prefixes[i], strlen(prefixes[i])) == 0) return 1;
+	}
+	return 0;
+}
+
+// Returns a socket to a worker that accepted the job, -1 if there is none
+static int get_worker() {
+	const char *workers = getenv("CC2CL_WORKERS");
+	if(!workers || !*workers) return -1;
+	const char *s = getenv("CC2CL_WORKER_TIMEOUT");
+	int timeout = s ? atoi(s) : 500;
+	unsigned int count = 1, i;
+	for(s = workers; *s; s++) if(*s == ',') count++;
+	const char *addresses[count];
+	size_t lengths[count];
+	for(i = 0, s = workers; i < count; i++) {
+		addresses[i] = s;
+		lengths[i] = strcspn(s, ",");
+		s += lengths[i] + 1;
+	}
+	unsigned int start = getpid() % count;
+	for(i = 0; i < count; i++) {
+		unsigned int k = (start + i) % count;
+		if(!lengths[k]) continue;
+		char address[lengths[k] + 1];
+		memcpy(address, addresses[k], lengths[k]);
+		address[lengths[k]] = 0;
+		int fd = dist_connect(address, timeout);
+		if(fd == -1) continue;
+		struct timeval tv = { .tv_sec = timeout / 1000, .tv_usec = timeout % 1000 * 1000 }, no_timeout = { 0 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+		uint32_t magic, state;
+		if(dist_recv_u32(fd, &magic) == 0 && magic == DIST_MAGIC && dist_recv_u32(fd, &state) == 0 && state == DIST_READY) {
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &no_timeout, sizeof no_timeout);
+			return fd;
+		}
+		close(fd);
+	}
+	return -1;
+}
+
+// Starts cl -E with the output going to output_fd
+static pid_t start_preprocessor(const char *compiler, char **argv, int output_fd, int other_fd) {
+	children_block_signals();
 	pid_t pid = fork();
+	child_add(pid);
 	if(pid == -1) {
 		perror("fork");
-		abort();
+		return -1;
 	}
 	if(pid == 0) {
-		if(target.type == PREPROCESSED_SOURCE && target.name) {
-			int fd = creat(target.name, 0666);
-			if(fd == -1) {
-				fprintf(stderr, "error: opening output file %s: %s\n", target.name, strerror(errno));
-				exit(1);
-			}
-			close(1);
-			dup2(fd, 1);
-		}
-		if(compiler) execvp(compiler, cl_argv);
-		execvp("cl", cl_argv);
+		child_setup();
+		restore_sigpipe();
+		dup2(output_fd, 1);
+		if(other_fd != -1) close(other_fd);
+		if(compiler) execvp(compiler, argv);
+		execvp("cl", argv);
 		perror("cl");
 		exit(127);
 	}
-	free_argv();
+	return pid;
+}
+
+static int wait_preprocessor(pid_t pid) {
 	int status;
-	if(waitpid(pid, &status, 0) < 0) {
+	while(waitpid(pid, &status, 0) < 0) {
+		if(errno == EINTR) continue;
 		perror("waitpid");
 		abort();
 	}
-	if(WIFSIGNALED(status)) {
-		fprintf(stderr, "cl terminated with signal %d\n", WTERMSIG(status));
-		return WTERMSIG(status) + 126;
+	child_remove(pid);
+	if(WIFSIGNALED(status)) return WTERMSIG(status) + 126;
+	return WEXITSTATUS(status);
+}
+
+// Returns the status of cl on a worker, or -1 to compile locally instead
+static int start_distributed(const char *compiler) {
+	if(target.type != OBJ || !target.name || multiple_input_files || !input_file_argv_index) return -1;
+	int language = get_input_language();
+	if(!language) return -1;
+	int fd = get_worker();
+	if(fd == -1) return -1;
+	if(!sigpipe_ignored) {
+		struct sigaction ignore = { .sa_handler = SIG_IGN };
+		sigemptyset(&ignore.sa_mask);
+		sigpipe_ignored = sigaction(SIGPIPE, &ignore, &sigpipe_action) == 0;
+	}
+
+	char *preprocess_argv[cl_argc + 2], *remote_argv[cl_argc];
+	int preprocess_argc = 0, remote_argc = 0, i;
+	preprocess_argv[preprocess_argc++] = cl_argv[0];
+	for(i = 1; i < cl_argc && strcmp(cl_argv[i], "-link"); i++) {
+		char *arg = cl_argv[i];
+		if(strcmp(arg, "-c") == 0 || strncmp(arg, "-Fo", 3) == 0) continue;
+		preprocess_argv[preprocess_argc++] = arg;
+		if(i == input_file_argv_index || is_local_option(arg)) continue;
+		// The debug information has to be in the object
+		if(strcmp(arg, "-Zi") == 0 || strcmp(arg, "-ZI") == 0) arg = "-Z7";
+		remote_argv[remote_argc++] = arg;
+	}
+	preprocess_argv[preprocess_argc++] = "-E";
+	preprocess_argv[preprocess_argc] = NULL;
+
+	// With -pipe the output of cl -E goes to the worker as it comes, otherwise through a file
+	int preprocessed_fd, pipe_fds[2], r = 0;
+	// If pipe() fails, as with no descriptors left, the file is used and the preprocessor is waited for there
+	int piped = pipe_mode && pipe(pipe_fds) == 0;
+	pid_t pid = -1;
+	if(piped) {
+		pid = start_preprocessor(compiler, preprocess_argv, pipe_fds[1], pipe_fds[0]);
+		close(pipe_fds[1]);
+		preprocessed_fd = pipe_fds[0];
+		if(pid == -1) {
+			close(preprocessed_fd);
+			close(fd);
+			return -1;
+		}
+	} else {
+		char *preprocessed = get_temp_name(target.name, ".i");
+		preprocessed_fd = open(preprocessed, O_RDWR | O_CREAT | O_TRUNC, 0666);
+		if(preprocessed_fd == -1) {
+			perror(preprocessed);
+			close(fd);
+			return -1;
+		}
+		unlink(preprocessed);
+		pid = start_preprocessor(compiler, preprocess_argv, preprocessed_fd, -1);
+		r = pid == -1 ? 127 : wait_preprocessor(pid);
+		if(r) {
+			close(preprocessed_fd);
+			close(fd);
+			return r;
+		}
+		lseek(preprocessed_fd, 0, SEEK_SET);
+	}
+	int sent = dist_send_u32(fd, remote_argc) == 0;
+	for(i = 0; sent && i < remote_argc; i++) sent = dist_send_string(fd, remote_argv[i]) == 0;
+	sent = sent && dist_send_u32(fd, language) == 0 && dist_send_stream(fd, preprocessed_fd) == 0;
+	// Closing the pipe stops a preprocessor that the worker no longer listens to
+	close(preprocessed_fd);
+	if(piped) {
+		r = wait_preprocessor(pid);
+		// If sending failed, the preprocessor was most likely stopped by the closed pipe
+		if(r && sent) {
+			dist_send_u32(fd, DIST_CANCEL);
+			close(fd);
+			return r;
+		}
+	}
+	sent = sent && dist_send_u32(fd, DIST_COMPILE) == 0;
+
+	uint32_t status;
+	char *worker_stdout = NULL, *worker_stderr = NULL;
+	int object_fd = -1;
+	if(sent && dist_recv_u32(fd, &status) == 0 &&
+	(worker_stdout = dist_recv_data(fd, 16 * 1024 * 1024)) &&
+	(worker_stderr = dist_recv_data(fd, 16 * 1024 * 1024)) &&
+	(object_fd = creat(temp_output, 0666)) != -1 &&
+	dist_recv_to_fd(fd, object_fd) >= 0) {
+		close(object_fd);
+		close(fd);
+		write_captured_output(worker_stdout, 1);
+		write_captured_output(worker_stderr, 2);
+		return status;
 	}
-	int r = WEXITSTATUS(status);
+	fprintf(stderr, "warning: lost connection to the compile worker, %s; compiling locally\n", strerror(errno));
+	if(object_fd != -1) {
+		close(object_fd);
+		unlink(temp_output);
+	}
+	free(worker_stdout);
+	free(worker_stderr);
+	close(fd);
+	return -1;
+}
 #endif
-	if(r || !target.name || target.type == PREPROCESSED_SOURCE) return r;
-	if(access(target.name, F_OK) == 0) return r;
 
-	size_t len = strlen(target.name);
-	int n = get_last_dot(target.name, len);
-	if(n >= 0) len = n;
-	char out[len + 4 + 1];
-	memcpy(out, target.name, len);
+// Call only once!
+int start_cl() {
+	record_command(cl_argc, cl_argv);
+	const char *compiler = snapshot_loaded && snapshot.compiler ? snapshot.compiler : getenv("CL_LOCATION");
+	if(target.type == PREPROCESSED_SOURCE && target.name) temp_output = get_temp_name(target.name, "");
+	unsigned int attempt = 0;
+	// With -E, cl's standard output is the result
+	int capture_stdout = target.type != PREPROCESSED_SOURCE;
+	char *captured_stdout = NULL, *captured_stderr = NULL;
+	retry_limit = get_retry_limit();
+#ifdef _WIN32
+	if(temp_object_directory && !CreateDirectoryA(temp_object_directory, NULL)) {
+		fprintf(stderr, "error: cannot create directory %s, error %lu\n", temp_object_directory, GetLastError());
+		return 1;
+	}
+	if(!snapshot_loaded) add_vs_bin_to_path();
+	char command_line[PATH_MAX * 2 + 1];
+	argv_to_command_line(cl_argv, command_line, sizeof command_line);
+	unsigned long int r;
+	while(1) {
+		STARTUPINFOA si = { .cb = sizeof(STARTUPINFOA) };
+		void *fh = INVALID_HANDLE_VALUE, *stdout_capture = INVALID_HANDLE_VALUE, *stderr_capture = INVALID_HANDLE_VALUE;
+		if(target.type == PREPROCESSED_SOURCE && target.name) {
+			SECURITY_ATTRIBUTES security_attr = {
+				.nLength = sizeof(SECURITY_ATTRIBUTES),
+				.lpSecurityDescriptor = NULL,
+				.bInheritHandle = 1
+			};
+			fh = CreateFileA(temp_output, GENERIC_WRITE, FILE_SHARE_READ, &security_attr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+			if(fh == INVALID_HANDLE_VALUE) {
+				fprintf(stderr, "error: opening output file %s: CreateFileA failed, error %lu\n", temp_output, GetLastError());
+				return 1;
+			}
+		}
+		if(retry_limit) {
+			if(capture_stdout) stdout_capture = create_capture_file();
+			stderr_capture = create_capture_file();
+		}
+		if(fh != INVALID_HANDLE_VALUE || stdout_capture != INVALID_HANDLE_VALUE || stderr_capture != INVALID_HANDLE_VALUE) {
+			si.hStdOutput = fh != INVALID_HANDLE_VALUE ? fh :
+				stdout_capture != INVALID_HANDLE_VALUE ? stdout_capture : GetStdHandle(STD_OUTPUT_HANDLE);
+			si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+			si.hStdError = stderr_capture != INVALID_HANDLE_VALUE ? stderr_capture : GetStdHandle(STD_ERROR_HANDLE);
+			si.dwFlags |= STARTF_USESTDHANDLES;
+		}
+		PROCESS_INFORMATION pi;
+		stats_compile_begin();
+		while(!CreateProcessA(compiler, command_line, NULL, NULL, 1, CREATE_SUSPENDED, NULL, NULL, &si, &pi)) {
+			if(compiler) {
+				compiler = NULL;
+				continue;
+			}
+			unsigned long int e = GetLastError();
+			if((e == ERROR_NOT_ENOUGH_MEMORY || e == ERROR_NO_SYSTEM_RESOURCES) && attempt < retry_limit) {
+				retry_sleep(attempt++);
+				continue;
+			}
+			fprintf(stderr, "CreateProcessA failed, error %lu\n", e);
+			return 127;
+		}
+		child_add(pi.hProcess);
+		ResumeThread(pi.hThread);
+		WaitForSingleObject(pi.hProcess, INFINITE);
+		GetExitCodeProcess(pi.hProcess, &r);
+		CloseHandle(pi.hProcess);
+		CloseHandle(pi.hThread);
+		stats_compile_end();
+		if(fh != INVALID_HANDLE_VALUE) CloseHandle(fh);
+		captured_stdout = read_capture_file(stdout_capture);
+		captured_stderr = read_capture_file(stderr_capture);
+		if(!r || attempt >= retry_limit || (!is_transient_failure(captured_stdout) && !is_transient_failure(captured_stderr))) break;
+		fprintf(stderr, "warning: transient cl failure, retrying (%u of %u)\n", attempt + 1, retry_limit);
+		free(captured_stdout);
+		free(captured_stderr);
+		retry_sleep(attempt++);
+	}
+	jobserver_release();
+	write_captured_output(captured_stdout, GetStdHandle(STD_OUTPUT_HANDLE));
+	write_captured_output(captured_stderr, GetStdHandle(STD_ERROR_HANDLE));
 
-	assert(target.type == EXE || target.type == OBJ);
-	strcpy(out + len, target.type == EXE ? ".exe" : ".obj");
-	if(access(out, F_OK) < 0) {
-		perror(NULL);
+#else
+	stats_compile_begin();
+	int r = start_distributed(compiler);
+	stats_compile_end();
+	if(r >= 0) {
+		free_argv();
+		return finish_output(r);
+	}
+	if(temp_object_directory && mkdir(temp_object_directory, 0777) < 0) {
+		perror(temp_object_directory);
 		return 1;
 	}
-/*
-	if(target.type == EXE) {
-		char manifest[len + 4 + 9 + 1];
-		memcpy(manifest, out, len + 4);
-		strcpy(manifest + len + 4, ".manifest");
-		unlink(manifest);
-	}*/
-	return -rename(out, target.name);
+	throttle_acquire(first_input_file);
+	while(1) {
+		int stdout_capture = -1, stderr_capture = -1;
+		if(retry_limit) {
+			if(capture_stdout) stdout_capture = create_capture_file();
+			stderr_capture = create_capture_file();
+		}
+		stats_compile_begin();
+		children_block_signals();
+		pid_t pid = fork();
+		if(pid) child_add(pid);
+		if(pid == -1) {
+			if(errno == EAGAIN && attempt < retry_limit && !children_received_signal) {
+				if(stdout_capture != -1) close(stdout_capture);
+				if(stderr_capture != -1) close(stderr_capture);
+				retry_sleep(attempt++);
+				continue;
+			}
+			perror("fork");
+			abort();
+		}
+		if(pid == 0) {
+			child_setup();
+			restore_sigpipe();
+			if(target.type == PREPROCESSED_SOURCE && target.name) {
+				int fd = creat(temp_output, 0666);
+				if(fd == -1) {
+					fprintf(stderr, "error: opening output file %s: %s\n", temp_output, strerror(errno));
+					exit(1);
+				}
+				close(1);
+				dup2(fd, 1);
+			}
+			if(stdout_capture != -1) dup2(stdout_capture, 1);
+			if(stderr_capture != -1) dup2(stderr_capture, 2);
+			if(compiler) execvp(compiler, cl_argv);
+			execvp("cl", cl_argv);
+			perror("cl");
+			exit(127);
+		}
+		int status;
+		while(waitpid(pid, &status, 0) < 0) {
+			if(errno == EINTR) continue;
+			perror("waitpid");
+			abort();
+		}
+		child_remove(pid);
+		stats_compile_end();
+		captured_stdout = read_capture_file(stdout_capture);
+		captured_stderr = read_capture_file(stderr_capture);
+		if(WIFSIGNALED(status)) {
+			write_captured_output(captured_stdout, 1);
+			write_captured_output(captured_stderr, 2);
+			captured_stdout = captured_stderr = NULL;
+			fprintf(stderr, "cl terminated with signal %d\n", WTERMSIG(status));
+			r = WTERMSIG(status) + 126;
+			break;
+		}
+		r = WEXITSTATUS(status);
+		if(!r || attempt >= retry_limit || children_received_signal || (!is_transient_failure(captured_stdout) && !is_transient_failure(captured_stderr))) break;
+		fprintf(stderr, "warning: transient cl failure, retrying (%u of %u)\n", attempt + 1, retry_limit);
+		free(captured_stdout);
+		free(captured_stderr);
+		retry_sleep(attempt++);
+	}
+	free_argv();
+	throttle_release();
+	jobserver_release();
+	write_captured_output(captured_stdout, 1);
+	write_captured_output(captured_stderr, 2);
+#endif
+	if(!r && !target.name && target.type == OBJ) return rename_objects();
+	return finish_output(r);
 }
 
 static int no_static_link = 1;
@@ -354,6 +1214,30 @@ void cl_help() {
 	exit(0);
 }
 
+static void __attribute__((__noreturn__)) stats_unavailable(const char *name) {
+	const char *file = getenv("BUILD_STATS_FILE");
+	if(file) fprintf(stderr, "%s: error: cannot map statistics file %s\n", name, file);
+	else fprintf(stderr, "%s: error: BUILD_STATS_FILE is not set\n", name);
+	exit(1);
+}
+
+void print_stats(const char *name) {
+	if(stats_print(stdout) < 0) stats_unavailable(name);
+	exit(0);
+}
+
+void reset_stats(const char *name) {
+	if(stats_reset() < 0) stats_unavailable(name);
+	exit(0);
+}
+
+static int reproducible;
+
+void set_reproducible() {
+	reproducible = 1;
+	add_to_argv("-Brepro");
+}
+
 void version() {
 	puts("libdll.so cc2cl " VERSION);
 	puts("Copyright 2015 libdll.so");
@@ -365,7 +1249,7 @@ void version() {
 }
 
 static struct option singal_dash_long_options[] = {
-	{ "pipe", 0, NULL },
+	{ "pipe", 0, set_pipe },
 	{ "ansi", 0, NULL },
 	{ "include", 1, include_file },
 	{ "nostdinc", 0, nostdinc },
@@ -382,7 +1266,7 @@ static struct option singal_dash_long_options[] = {
 };
 
 static struct option double_dash_long_options[] = {
-	{ "pipe", 0, NULL },
+	{ "pipe", 0, set_pipe },
 	{ "ansi", 0, NULL },
 	{ "include", 1, include_file },
 	{ "static", 0, static_link },
@@ -395,61 +1279,419 @@ static struct option double_dash_long_options[] = {
 	{ "debug", 0, set_debug },
 	{ "help", 0, help },
 	{ "cl-help", 0, cl_help },
+	{ "stats", 0, print_stats },
+	{ "reset-stats", 0, reset_stats },
+	{ "snapshot", 0, write_snapshot },
+	{ "reproducible", 0, set_reproducible },
 	{ "version", 0, version }
 };
 
-void add_include_path(const char *path, int no_warning) {
-#if defined __INTERIX && !defined _NO_CONV_PATH
-	if(*path == '/') {
-		static char buffer[2 + PATH_MAX + 1] = { '-', 'I' };
-		if(unixpath2win(path, 0, buffer + 2, sizeof buffer - 2) == 0) {
-			add_to_argv(buffer);
+/*	Unix to Windows path mapping.  CC2CL_PATH_MAP selects the prefix table:
+	'wine' reads the drive symlinks in $WINEPREFIX/dosdevices, 'wsl' the
+	drvfs mounts in /proc/mounts, 'cygwin' maps /cygdrive/<letter>, and
+	anything else names a file of '<unix prefix> <windows prefix>' lines.
+*/
+struct path_mapping {
+	char *unix_prefix;		// Without the trailing '/', so '/' is empty
+	size_t unix_prefix_len;
+	char *windows_prefix;		// Without the trailing '\'
+};
+
+static struct path_mapping *path_mappings;
+static unsigned int path_mappings_count;
+
+// Maps a directory to the index of its longest matching prefix, or -1
+#define PATH_MAP_CACHE_SIZE 1024
+static struct {
+	char *directory;
+	int mapping;
+} path_map_cache[PATH_MAP_CACHE_SIZE];
+static unsigned int path_map_cache_count;
+
+static void add_path_mapping(const char *unix_prefix, size_t unix_prefix_len, const char *windows_prefix, size_t windows_prefix_len) {
+	while(unix_prefix_len && unix_prefix[unix_prefix_len - 1] == '/') unix_prefix_len--;
+	while(windows_prefix_len && (windows_prefix[windows_prefix_len - 1] == '\\' || windows_prefix[windows_prefix_len - 1] == '/')) windows_prefix_len--;
+	path_mappings = realloc(path_mappings, (path_mappings_count + 1) * sizeof *path_mappings);
+	if(!path_mappings) {
+		perror(NULL);
+		abort();
+	}
+	struct path_mapping *m = path_mappings + path_mappings_count++;
+	m->unix_prefix = malloc(unix_prefix_len + 1);
+	m->windows_prefix = malloc(windows_prefix_len + 1);
+	if(!m->unix_prefix || !m->windows_prefix) {
+		perror(NULL);
+		abort();
+	}
+	memcpy(m->unix_prefix, unix_prefix, unix_prefix_len);
+	m->unix_prefix[unix_prefix_len] = 0;
+	m->unix_prefix_len = unix_prefix_len;
+	memcpy(m->windows_prefix, windows_prefix, windows_prefix_len);
+	m->windows_prefix[windows_prefix_len] = 0;
+}
+
+static int compare_path_mappings(const void *a, const void *b) {
+	size_t a_len = ((const struct path_mapping *)a)->unix_prefix_len;
+	size_t b_len = ((const struct path_mapping *)b)->unix_prefix_len;
+	return a_len < b_len ? 1 : a_len > b_len ? -1 : 0;
+}
+
+static void load_path_map() {
+	static int loaded;
+	if(loaded) return;
+	loaded = 1;
+	const char *map = getenv("CC2CL_PATH_MAP");
+	if(!map || !*map) return;
+	char windows_prefix[3] = "?:";
+#ifndef _WIN32
+	if(strcmp(map, "wine") == 0) {
+		const char *prefix = getenv("WINEPREFIX");
+		const char *home = getenv("HOME");
+		char dir[PATH_MAX + 1];
+		if(prefix) snprintf(dir, sizeof dir, "%s/dosdevices", prefix);
+		else snprintf(dir, sizeof dir, "%s/.wine/dosdevices", home ? home : "");
+		DIR *d = opendir(dir);
+		if(!d) {
+			perror(dir);
 			return;
+		}
+		struct dirent *e;
+		while((e = readdir(d))) {
+			if(!isalpha(e->d_name[0]) || e->d_name[1] != ':' || e->d_name[2]) continue;
+			char link[sizeof dir + sizeof e->d_name], target[PATH_MAX + 1];
+			snprintf(link, sizeof link, "%s/%s", dir, e->d_name);
+			if(!realpath(link, target)) continue;
+			*windows_prefix = toupper(e->d_name[0]);
+			add_path_mapping(target, strlen(target), windows_prefix, 2);
+		}
+		closedir(d);
+	} else if(strcmp(map, "wsl") == 0) {
+		FILE *f = fopen("/proc/mounts", "r");
+		if(!f) {
+			perror("/proc/mounts");
+			return;
+		}
+		char device[PATH_MAX + 1], mount_point[PATH_MAX + 1], type[32];
+		while(fscanf(f, "%4096s %4096s %31s%*[^\n]", device, mount_point, type) == 3) {
+			if(strcmp(type, "drvfs") && strcmp(type, "9p")) continue;
+			if(strncmp(mount_point, "/mnt/", 5) || !isalpha(mount_point[5]) || mount_point[6]) continue;
+			*windows_prefix = toupper(mount_point[5]);
+			add_path_mapping(mount_point, 6, windows_prefix, 2);
+		}
+		fclose(f);
+	} else
+#endif
+	if(strcmp(map, "cygwin") == 0) {
+		char unix_prefix[] = "/cygdrive/?";
+		char c;
+		for(c = 'a'; c <= 'z'; c++) {
+			unix_prefix[10] = c;
+			*windows_prefix = toupper(c);
+			add_path_mapping(unix_prefix, 11, windows_prefix, 2);
+		}
+	} else {
+		FILE *f = fopen(map, "r");
+		if(!f) {
+			perror(map);
+			return;
+		}
+		char line[PATH_MAX * 2 + 2];
+		while(fgets(line, sizeof line, f)) {
+			char *p = line, *unix_prefix;
+			while(isspace(*p)) p++;
+			if(!*p || *p == '#') continue;
+			unix_prefix = p;
+			while(*p && !isspace(*p)) p++;
+			size_t unix_prefix_len = p - unix_prefix;
+			while(isspace(*p)) p++;
+			size_t windows_prefix_len = strlen(p);
+			while(windows_prefix_len && isspace(p[windows_prefix_len - 1])) windows_prefix_len--;
+			if(!windows_prefix_len) {
+				fprintf(stderr, "warning: %s: no Windows path for '%.*s'\n", map, (int)unix_prefix_len, unix_prefix);
+				continue;
+			}
+			add_path_mapping(unix_prefix, unix_prefix_len, p, windows_prefix_len);
+		}
+		fclose(f);
+	}
+	qsort(path_mappings, path_mappings_count, sizeof *path_mappings, compare_path_mappings);
+}
+
+static int find_path_mapping(const char *path, size_t len) {
+	unsigned int i;
+	for(i = 0; i < path_mappings_count; i++) {
+		const struct path_mapping *m = path_mappings + i;
+		if(m->unix_prefix_len > len || memcmp(path, m->unix_prefix, m->unix_prefix_len)) continue;
+		if(m->unix_prefix_len == len || path[m->unix_prefix_len] == '/') return i;
+	}
+	return -1;
+}
+
+// The prefix of a path is looked up by its directory, so files of one directory share a cache entry
+static int find_path_mapping_cached(const char *path) {
+	size_t path_len = strlen(path), len = path_len;
+	unsigned int i;
+	// Only a prefix naming the path itself is longer than its directory
+	for(i = 0; i < path_mappings_count && path_mappings[i].unix_prefix_len >= path_len; i++) {
+		if(path_mappings[i].unix_prefix_len == path_len && memcmp(path, path_mappings[i].unix_prefix, path_len) == 0) return i;
+	}
+	while(len && path[len - 1] != '/') len--;
+	if(len) len--;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t j;
+	for(j = 0; j < len; j++) h = (h ^ (unsigned char)path[j]) * 0x100000001b3ULL;
+	unsigned int slot = h % PATH_MAP_CACHE_SIZE;
+	while(path_map_cache[slot].directory) {
+		const char *directory = path_map_cache[slot].directory;
+		if(strncmp(directory, path, len) == 0 && !directory[len]) return path_map_cache[slot].mapping;
+		slot = (slot + 1) % PATH_MAP_CACHE_SIZE;
+	}
+	int mapping = find_path_mapping(path, len);
+	if(path_map_cache_count < PATH_MAP_CACHE_SIZE / 4 * 3 && (path_map_cache[slot].directory = malloc(len + 1))) {
+		memcpy(path_map_cache[slot].directory, path, len);
+		path_map_cache[slot].directory[len] = 0;
+		path_map_cache[slot].mapping = mapping;
+		path_map_cache_count++;
+	}
+	return mapping;
+}
+
+/*	Returns the Windows form of an absolute Unix path, or the path itself if
+	it is relative.  Without a mapping the slashes are just turned around, so
+	cl won't take the path for an option.
+*/
+static const char *convert_path(const char *path, int no_warning) {
+	if(*path != '/') return path;
+	load_path_map();
+	const char *windows_prefix = "";
+	size_t prefix_len = 0;
+	if(path_mappings_count) {
+		int i = find_path_mapping_cached(path);
+		if(i >= 0) {
+			windows_prefix = path_mappings[i].windows_prefix;
+			prefix_len = path_mappings[i].unix_prefix_len;
 		} else if(!no_warning) {
+			fprintf(stderr, "warning: no Windows path mapping for '%s'\n", path);
+		}
+	}
+#if defined __INTERIX && !defined _NO_CONV_PATH
+	else {
+		char buffer[PATH_MAX + 1];
+		if(unixpath2win(path, 0, buffer, sizeof buffer) == 0) {
+			char *r = strdup(buffer);
+			if(!r) {
+				perror(NULL);
+				abort();
+			}
+			return r;
+		}
+		if(!no_warning) {
 			fprintf(stderr, "warning: cannot convert '%s' to Windows path name, %s\n", path, strerror(errno));
 		}
 	}
 #endif
-	char buffer[2 + strlen(path) + 1];
-	strcpy(buffer, "-I");
-	strcpy(buffer + 2, path);
-	add_to_argv(buffer);
+	size_t windows_prefix_len = strlen(windows_prefix);
+	const char *rest = path + prefix_len;
+	char *r = malloc(windows_prefix_len + 1 + strlen(rest) + 1), *p = r;
+	if(!r) {
+		perror(NULL);
+		abort();
+	}
+	memcpy(p, windows_prefix, windows_prefix_len);
+	p += windows_prefix_len;
+	// The path is the prefix itself; 'X:' alone would be the current directory of X
+	if(!*rest && (!windows_prefix_len || windows_prefix[windows_prefix_len - 1] == ':')) *p++ = '\\';
+	while(*rest) {
+		*p++ = *rest == '/' ? '\\' : *rest;
+		rest++;
+	}
+	*p = 0;
+	return r;
+}
+
+/*	The -I and -L directories are collected here and passed once, after the
+	options are parsed, without duplicates or directories that don't exist.
+	A directory is only checked when it can be here; one given the Windows
+	way, with a drive letter or backslashes, is for cl to find and is kept.
+	Existing directories are remembered in the file named by CC2CL_STAT_CACHE,
+	so a build stats each directory once; a missing directory is never
+	cached, since it may be created by a later build step.
+*/
+struct search_path {
+	const char *path;		// As given, for stat
+	const char *windows_path;
+};
+
+struct search_path_list {
+	struct search_path *paths;
+	unsigned int count;
+};
+
+static struct search_path_list include_paths, library_paths;
+
+static void add_search_path(struct search_path_list *list, const char *path, int no_warning) {
+	list->paths = realloc(list->paths, (list->count + 1) * sizeof *list->paths);
+	if(!list->paths) {
+		perror(NULL);
+		abort();
+	}
+	list->paths[list->count].path = path;
+	list->paths[list->count].windows_path = convert_path(path, no_warning);
+	list->count++;
+}
+
+void add_include_path(const char *path, int no_warning) {
+	add_search_path(&include_paths, path, no_warning);
+}
+
+void add_library_path(const char *path, int no_warning) {
+	add_search_path(&library_paths, path, no_warning);
+}
+
+#ifndef _WIN32
+#define STAT_CACHE_SLOTS 4096
+#define STAT_CACHE_PROBES 16
+
+static uint64_t *stat_cache;
+
+static void map_stat_cache() {
+	static int mapped;
+	if(mapped) return;
+	mapped = 1;
+	const char *file = getenv("CC2CL_STAT_CACHE");
+	if(!file || !*file) return;
+	int fd = open(file, O_RDWR | O_CREAT, 0666);
+	if(fd == -1) return;
+	struct stat st;
+	if(fstat(fd, &st) < 0 || (st.st_size < STAT_CACHE_SLOTS * sizeof(uint64_t) && ftruncate(fd, STAT_CACHE_SLOTS * sizeof(uint64_t)) < 0)) {
+		close(fd);
+		return;
+	}
+	stat_cache = mmap(NULL, STAT_CACHE_SLOTS * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(stat_cache == MAP_FAILED) stat_cache = NULL;
+}
+
+// Relative directories are keyed by the current directory too
+static uint64_t get_directory_key(const char *path) {
+	static char *cwd;
+	uint64_t h;
+	if(*path == '/') h = hash_string(path);
+	else {
+		if(!cwd && !(cwd = getcwd(NULL, 0))) return 0;
+		size_t cwd_len = strlen(cwd);
+		char buffer[cwd_len + 1 + strlen(path) + 1];
+		memcpy(buffer, cwd, cwd_len);
+		buffer[cwd_len] = '/';
+		strcpy(buffer + cwd_len + 1, path);
+		h = hash_string(buffer);
+	}
+	return h ? h : 1;
+}
+#endif
+
+// Whether path names a directory of the file system this program sees
+static int is_checkable_path(const char *path) {
+#ifdef _WIN32
+	return 1;
+#else
+	if(isalpha((unsigned char)path[0]) && path[1] == ':') return 0;
+	return !strchr(path, '\\');
+#endif
 }
 
-void add_library_path(const char *path, int no_warning) {
-	static char *llib;
-	const char *lib = getenv("LIB");
-	char *old_path = lib ? strdup(lib) : (char *)"";
-	if(!old_path) {
-		perror(NULL);
-		abort();
+static int directory_exists(const char *path) {
+#ifdef _WIN32
+	unsigned long int attributes = GetFileAttributesA(path);
+	return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+	map_stat_cache();
+	uint64_t key = stat_cache ? get_directory_key(path) : 0;
+	unsigned int i;
+	if(key) for(i = 0; i < STAT_CACHE_PROBES; i++) {
+		if(__atomic_load_n(stat_cache + (key + i) % STAT_CACHE_SLOTS, __ATOMIC_RELAXED) == key) return 1;
 	}
-#if defined __INTERIX && !defined _NO_CONV_PATH
-	if(*path == '/') {
-		static char buffer[PATH_MAX + 1];
-		if(unixpath2win(path, 0, buffer, sizeof buffer) == 0) {
-			path = buffer;
-		} else if(!no_warning) {
-			fprintf(stderr, "warning: cannot convert '%s' to Windows path name, %s\n", path, strerror(errno));
-		}
+	struct stat st;
+	if(stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) return 0;
+	if(key) for(i = 0; i < STAT_CACHE_PROBES; i++) {
+		uint64_t empty = 0;
+		if(__atomic_compare_exchange_n(stat_cache + (key + i) % STAT_CACHE_SLOTS, &empty, key, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) || empty == key) break;
 	}
+	return 1;
 #endif
-	size_t old_path_len = strlen(old_path);
-	size_t new_path_len = strlen(path);
-	//llib = realloc(llib, 4 + new_path_len + 1 + old_path_len + 1);
-	free(llib);
-	llib = malloc(4 + new_path_len + 1 + old_path_len + 1);
+}
+
+// Drops the duplicates and the missing directories, keeping the first occurrence of each
+static void filter_search_paths(struct search_path_list *list, int verbose) {
+	unsigned int table_size = 16, i, j, count = 0;
+	while(table_size < list->count * 2) table_size *= 2;
+	unsigned int table[table_size];		// Indexes into list->paths plus one
+	memset(table, 0, sizeof table);
+	for(i = 0; i < list->count; i++) {
+		const char *path = list->paths[i].windows_path;
+		size_t len = strlen(path);
+		while(len > 1 && (path[len - 1] == '\\' || path[len - 1] == '/') && path[len - 2] != ':') len--;
+		uint64_t h = 0xcbf29ce484222325ULL;
+		for(j = 0; j < len; j++) h = (h ^ (unsigned char)(path[j] == '/' ? '\\' : path[j])) * 0x100000001b3ULL;
+		unsigned int slot = h & (table_size - 1);
+		int duplicate = 0;
+		while(table[slot]) {
+			const char *other = list->paths[table[slot] - 1].windows_path;
+			for(j = 0; j < len && other[j] && (other[j] == path[j] || ((other[j] == '/' || other[j] == '\\') && (path[j] == '/' || path[j] == '\\'))); j++);
+			if(j == len) {
+				while(other[j] == '\\' || other[j] == '/') j++;
+				if(!other[j]) {
+					duplicate = 1;
+					break;
+				}
+			}
+			slot = (slot + 1) & (table_size - 1);
+		}
+		if(duplicate) {
+			if(verbose) fprintf(stderr, "ignoring duplicate directory \"%s\"\n", list->paths[i].path);
+			continue;
+		}
+		if(is_checkable_path(list->paths[i].path) && !directory_exists(list->paths[i].path)) {
+			if(verbose) fprintf(stderr, "ignoring nonexistent directory \"%s\"\n", list->paths[i].path);
+			continue;
+		}
+		list->paths[count] = list->paths[i];
+		table[slot] = ++count;
+	}
+	list->count = count;
+}
+
+void add_search_paths_to_argv(int verbose) {
+	unsigned int i;
+	filter_search_paths(&include_paths, verbose);
+	for(i = 0; i < include_paths.count; i++) {
+		const char *path = include_paths.paths[i].windows_path;
+		char buffer[2 + strlen(path) + 1];
+		strcpy(buffer, "-I");
+		strcpy(buffer + 2, path);
+		add_to_argv(buffer);
+	}
+	filter_search_paths(&library_paths, verbose);
+	if(!library_paths.count) return;
+	// The -L directories are searched first, in the order given
+	const char *lib = getenv("LIB");
+	size_t len = 4 + (lib ? strlen(lib) : 0) + 1;
+	for(i = 0; i < library_paths.count; i++) len += strlen(library_paths.paths[i].windows_path) + 1;
+	char *llib = malloc(len), *p = llib;
 	if(!llib) {
 		perror(NULL);
 		abort();
 	}
-	memcpy(llib, "LIB=", 4);
-	memcpy(llib + 4, path, new_path_len);
-	if(old_path_len) {
-		llib[4 + new_path_len] = ';';
-		memcpy(llib + 4 + new_path_len + 1, old_path, old_path_len + 1);
-		free(old_path);
-	} else llib[4 + new_path_len] = 0;
+	memcpy(p, "LIB=", 4);
+	p += 4;
+	for(i = 0; i < library_paths.count; i++) {
+		size_t path_len = strlen(library_paths.paths[i].windows_path);
+		memcpy(p, library_paths.paths[i].windows_path, path_len);
+		p += path_len;
+		*p++ = ';';
+	}
+	if(lib && *lib) strcpy(p, lib);
+	else p[-1] = 0;
 	putenv(llib);
 }
 
@@ -465,11 +1707,220 @@ void add_library(const char *lib) {
 	libs[libs_count - 1] = lib;
 }
 
+static const char **link_options;
+static unsigned int link_options_count;
+
+void add_link_option(const char *option) {
+	link_options = realloc(link_options, ++link_options_count * sizeof(char *));
+	if(!link_options) {
+		perror(NULL);
+		abort();
+	}
+	link_options[link_options_count - 1] = option;
+}
+
+/*	With CC2CL_RESOLVE_LIBS set, the -L and LIB directories are read once
+	into a table of file names, and each -l is passed to link as the path of
+	the first match in search order, trying <name>.lib, lib<name>.lib,
+	lib<name>.dll.a and lib<name>.a in each directory; -l:<file> matches
+	<file> exactly.  If every directory could be read, a library found
+	nowhere is an error before link even starts.
+*/
+struct library_index_entry {
+	char *name;
+	unsigned int directory;		// Position in the search order
+};
+
+static struct library_index_entry *library_index;
+static unsigned int library_index_size;		// A power of 2
+static unsigned int library_index_count;
+static const char **resolved_libs;
+
+static uint64_t hash_library_name(const char *name) {
+#ifdef _WIN32
+	uint64_t h = 0xcbf29ce484222325ULL;
+	while(*name) h = (h ^ (unsigned char)tolower(*name++)) * 0x100000001b3ULL;
+	return h;
+#else
+	return hash_string(name);
+#endif
+}
+
+static int library_name_equal(const char *a, const char *b) {
+#ifdef _WIN32
+	return strcasecmp(a, b) == 0;
+#else
+	return strcmp(a, b) == 0;
+#endif
+}
+
+static void add_library_index_entry(char *name, unsigned int directory) {
+	unsigned int i;
+	if(library_index_count * 2 >= library_index_size) {
+		struct library_index_entry *old_index = library_index;
+		unsigned int old_size = library_index_size;
+		library_index_size = old_size ? old_size * 2 : 1024;
+		library_index = calloc(library_index_size, sizeof *library_index);
+		if(!library_index) {
+			perror(NULL);
+			abort();
+		}
+		library_index_count = 0;
+		for(i = 0; i < old_size; i++) {
+			if(old_index[i].name) add_library_index_entry(old_index[i].name, old_index[i].directory);
+		}
+		free(old_index);
+	}
+	i = hash_library_name(name) & (library_index_size - 1);
+	while(library_index[i].name) {
+		// The first directory wins, like in the linker's own search
+		if(library_name_equal(library_index[i].name, name)) {
+			free(name);
+			return;
+		}
+		i = (i + 1) & (library_index_size - 1);
+	}
+	library_index[i].name = name;
+	library_index[i].directory = directory;
+	library_index_count++;
+}
+
+// Returns -1 if the directory couldn't be read
+static int index_library_directory(const char *path, unsigned int directory) {
+#ifdef _WIN32
+	char pattern[strlen(path) + 3];
+	sprintf(pattern, "%s\\*", path);
+	WIN32_FIND_DATAA data;
+	void *h = FindFirstFileA(pattern, &data);
+	if(h == INVALID_HANDLE_VALUE) return -1;
+	do {
+		if(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+		char *name = strdup(data.cFileName);
+		if(!name) {
+			perror(NULL);
+			abort();
+		}
+		add_library_index_entry(name, directory);
+	} while(FindNextFileA(h, &data));
+	FindClose(h);
+#else
+	DIR *d = opendir(path);
+	if(!d) return -1;
+	struct dirent *e;
+	while((e = readdir(d))) {
+		if(*e->d_name == '.') continue;
+		char *name = strdup(e->d_name);
+		if(!name) {
+			perror(NULL);
+			abort();
+		}
+		add_library_index_entry(name, directory);
+	}
+	closedir(d);
+#endif
+	return 0;
+}
+
+static const struct library_index_entry *find_library_index_entry(const char *name) {
+	if(!library_index_size) return NULL;
+	unsigned int i = hash_library_name(name) & (library_index_size - 1);
+	while(library_index[i].name) {
+		if(library_name_equal(library_index[i].name, name)) return library_index + i;
+		i = (i + 1) & (library_index_size - 1);
+	}
+	return NULL;
+}
+
+// Call after add_search_paths_to_argv, which puts the -L directories first in LIB
+int resolve_libraries(const char *name) {
+	const char *resolve = getenv("CC2CL_RESOLVE_LIBS");
+	if(!resolve || !*resolve || !libs_count) return 0;
+	unsigned int directories_count = library_paths.count, i, j;
+	int complete = 1;
+	for(i = 0; i < library_paths.count; i++) {
+		if(index_library_directory(library_paths.paths[i].path, i) < 0) complete = 0;
+	}
+	// The -L directories are already indexed by their Unix names
+	const char *lib = getenv("LIB");
+	const char *directories[library_paths.count + (lib ? strlen(lib) / 2 + 1 : 0)];
+	char lib_buffer[lib ? strlen(lib) + 1 : 1];
+	if(lib) {
+		char *p = strcpy(lib_buffer, lib), *s;
+		for(i = 0; p; i++) {
+			s = p;
+			if((p = strchr(p, ';'))) *p++ = 0;
+			if(i < library_paths.count || !*s) continue;
+			directories[directories_count] = s;
+			if(index_library_directory(s, directories_count) < 0) complete = 0;
+			directories_count++;
+		}
+	}
+	for(i = 0; i < library_paths.count; i++) directories[i] = library_paths.paths[i].windows_path;
+
+	resolved_libs = calloc(libs_count, sizeof(char *));
+	if(!resolved_libs) {
+		perror(NULL);
+		abort();
+	}
+	int r = 0;
+	for(i = 0; i < libs_count; i++) {
+		const char *l = libs[i];
+		size_t len = strlen(l);
+		char candidates[4][3 + len + 6 + 1];
+		int n;
+		if(*l == ':') {
+			strcpy(candidates[0], l + 1);
+			n = 1;
+		} else {
+			sprintf(candidates[0], "%s.lib", l);
+			sprintf(candidates[1], "lib%s.lib", l);
+			sprintf(candidates[2], "lib%s.dll.a", l);
+			sprintf(candidates[3], "lib%s.a", l);
+			n = 4;
+		}
+		const struct library_index_entry *found = NULL;
+		for(j = 0; j < n; j++) {
+			const struct library_index_entry *e = find_library_index_entry(candidates[j]);
+			if(e && (!found || e->directory < found->directory)) found = e;
+		}
+		if(!found) {
+			if(complete) {
+				fprintf(stderr, "%s: error: cannot find -l%s\n", name, l);
+				r = -1;
+			}
+			continue;
+		}
+		const char *directory = directories[found->directory];
+		size_t directory_len = strlen(directory);
+		char *path = malloc(directory_len + 1 + strlen(found->name) + 1);
+		if(!path) {
+			perror(NULL);
+			abort();
+		}
+		memcpy(path, directory, directory_len);
+		if(directory_len && directory[directory_len - 1] != '\\' && directory[directory_len - 1] != '/') {
+			path[directory_len++] = '\\';
+		}
+		strcpy(path + directory_len, found->name);
+		resolved_libs[i] = path;
+	}
+	return r;
+}
+
 void add_libraries_to_argv() {
 	int i;
-	if(!libs_count) return;
+	if(!libs_count && !link_options_count) return;
 	add_to_argv("-link");
+	for(i=0; i<link_options_count; i++) add_to_argv(link_options[i]);
 	for(i=0; i<libs_count; i++) {
+		if(resolved_libs && resolved_libs[i]) {
+			add_to_argv(resolved_libs[i]);
+			continue;
+		}
+		if(*libs[i] == ':') {
+			add_to_argv(libs[i] + 1);
+			continue;
+		}
 		size_t len = strlen(libs[i]);
 		char buffer[len + 4 + 1];
 		memcpy(buffer, libs[i], len);
@@ -478,8 +1929,140 @@ void add_libraries_to_argv() {
 	}
 }
 
+/*	With LINK_CACHE, a link of objects and libraries alone is skipped when
+	linkcache.h finds nothing changed.  A source to compile would need the
+	headers it includes in the key too, so such a link always runs.  The
+	.ilk and .manifest files are not checked.
+*/
+static int add_link_to_cache(struct linkcache *cache, char **argv) {
+	static const char *suffixes[] = { ".o", ".obj", ".a", ".lib", ".res" };
+	unsigned int i, j;
+	if(typed_input_files) return -1;
+	for(i = 0; i < input_file_names_count; i++) {
+		const char *file = input_file_names[i];
+		size_t len = strlen(file);
+		int n = get_last_dot(file, len);
+		if(n < 0) return -1;
+		for(j = 0; j < sizeof suffixes / sizeof *suffixes; j++) if(strcasecmp(file + n, suffixes[j]) == 0) break;
+		if(j == sizeof suffixes / sizeof *suffixes || linkcache_add_file(cache, file) < 0) return -1;
+	}
+
+	// The -L directories, then LIB, as resolve_libraries() looks
+	const char *lib = getenv("LIB");
+	const char *directories[library_paths.count + (lib ? strlen(lib) / 2 + 1 : 0)];
+	unsigned int directories_count = 0;
+	char lib_buffer[lib ? strlen(lib) + 1 : 1];
+	for(i = 0; i < library_paths.count; i++) directories[directories_count++] = library_paths.paths[i].path;
+	if(lib) {
+		char *p = strcpy(lib_buffer, lib);
+		// Empty fields are skipped, which keeps the fields within strlen(lib) / 2 + 1
+		while(p) {
+			char *s = p;
+			if((p = strchr(p, ';'))) *p++ = 0;
+			if(*s) directories[directories_count++] = s;
+		}
+	}
+	for(i = 0; i < libs_count; i++) {
+		const char *l = libs[i];
+		size_t len = strlen(l);
+		char candidates[4][3 + len + 6 + 1];
+		int n;
+		if(*l == ':') {
+			strcpy(candidates[0], l + 1);
+			n = 1;
+		} else {
+			sprintf(candidates[0], "%s.lib", l);
+			sprintf(candidates[1], "lib%s.lib", l);
+			sprintf(candidates[2], "lib%s.dll.a", l);
+			sprintf(candidates[3], "lib%s.a", l);
+			n = 4;
+		}
+		for(j = 0; j < n; j++) if(linkcache_add_found_file(cache, candidates[j], directories, directories_count) == 0) break;
+		if(j == n) linkcache_add_string(cache, l);
+	}
+
+	// Our own options, and the environment their translation depends on
+	while(*++argv) linkcache_add_string(cache, *argv);
+	cache->key = linkcache_mix(cache->key, snapshot_key);
+	const char *compiler = snapshot_loaded && snapshot.compiler ? snapshot.compiler : getenv("CL_LOCATION");
+	linkcache_add_tool(cache, compiler ? compiler : "cl");
+	// cl and the linker it runs take options from these too
+	linkcache_add_environment(cache, "CL");
+	linkcache_add_environment(cache, "_CL_");
+	linkcache_add_environment(cache, "LINK");
+	linkcache_add_environment(cache, "_LINK_");
+	linkcache_add_string(cache, target.name);
+
+	// The PDB and the import library set_output_file() names, and the .exp that comes with it
+	static const char *output_suffixes[] = { ".pdb", ".lib", ".exp" };
+	size_t len = strlen(target.name);
+	int n = get_last_dot(target.name, len);
+	if(n >= 0) len = n;
+	for(i = 0; i < sizeof output_suffixes / sizeof *output_suffixes; i++) {
+		char *output = malloc(len + 4 + 1);
+		if(!output) {
+			perror(NULL);
+			abort();
+		}
+		memcpy(output, target.name, len);
+		strcpy(output + len, output_suffixes[i]);
+		linkcache_add_output(cache, output);
+	}
+	return 0;
+}
+
+#define LTO_AUTO -1
+#define LTO_JOBSERVER -2
+static int lto_jobs;
+
+void set_lto(const char *jobs) {
+	add_to_argv("-GL");
+	if(!*jobs || strcmp(jobs, "=auto") == 0) lto_jobs = LTO_AUTO;
+	else if(strcmp(jobs, "=jobserver") == 0) lto_jobs = LTO_JOBSERVER;
+	else if(*jobs == '=' && atoi(jobs + 1) > 0) lto_jobs = atoi(jobs + 1);
+	else {
+		fprintf(stderr, "error: unrecognized argument to '-flto' option '%s'\n", jobs + 1);
+		exit(1);
+	}
+}
+
+#define PREFIX_MAP_DEBUG 1
+#define PREFIX_MAP_MACRO 2
+
+/*	-fdebug-prefix-map becomes -pathmap, which rewrites the paths recorded in
+	the debug information.  cl can only strip a prefix from __FILE__, so the
+	macro half of a mapping becomes -d1trimfile and ignores the new prefix.
+*/
+void set_prefix_map(const char *map, int flags) {
+	const char *eq = strchr(map, '=');
+	if(!eq) {
+		fprintf(stderr, "error: invalid argument '%s', expected <old>=<new>\n", map);
+		exit(4);
+	}
+	char old_prefix[eq - map + 1];
+	memcpy(old_prefix, map, eq - map);
+	old_prefix[eq - map] = 0;
+	const char *windows_prefix = convert_path(old_prefix, 1);
+	size_t len = strlen(windows_prefix);
+	if(flags & PREFIX_MAP_DEBUG) {
+		char buffer[9 + len + strlen(eq) + 1];
+		sprintf(buffer, "-pathmap:%s%s", windows_prefix, eq);
+		add_to_argv(buffer);
+	}
+	if(flags & PREFIX_MAP_MACRO) {
+		char buffer[12 + len + 1 + 1];
+		sprintf(buffer, "-d1trimfile:%s", windows_prefix);
+		if(len && windows_prefix[len - 1] != '\\' && windows_prefix[len - 1] != '/') strcat(buffer, "\\");
+		add_to_argv(buffer);
+	}
+}
+
 void set_feature(const char *feature) {
-	if(strcmp(feature, "no-builtin") == 0 || strcmp(feature, "no-builtin-function") == 0) add_to_argv("-Oi-");
+	if(strncmp(feature, "lto", 3) == 0 && (!feature[3] || feature[3] == '=')) set_lto(feature + 3);
+	else if(strncmp(feature, "file-prefix-map=", 16) == 0) set_prefix_map(feature + 16, PREFIX_MAP_DEBUG | PREFIX_MAP_MACRO);
+	else if(strncmp(feature, "debug-prefix-map=", 17) == 0) set_prefix_map(feature + 17, PREFIX_MAP_DEBUG);
+	else if(strncmp(feature, "macro-prefix-map=", 17) == 0) set_prefix_map(feature + 17, PREFIX_MAP_MACRO);
+	else if(strcmp(feature, "no-builtin") == 0 || strcmp(feature, "no-builtin-function") == 0) add_to_argv("-Oi-");
 	else if(strcmp(feature, "openmp") == 0) add_to_argv("-openmp");
 	else if(strcmp(feature, "ms-extensions") == 0) add_to_argv("-Ze");
 	else if(strcmp(feature, "unsigned-char") == 0 || strcmp(feature, "no-signed-char") == 0) add_to_argv("-J");
@@ -581,49 +2164,143 @@ void set_language(const char *lang) {
 	last_language_unused = 1;
 }
 
-static const char *first_input_file;
-static int multiple_input_files = 0;
+static void add_object_name(const char *file) {
+	size_t len = strlen(file);
+	int n = get_last_dot(file, len);
+	if(n >= 0) len = n;
+	const char *name = file + len;
+	while(name > file && name[-1] != '/' && name[-1] != '\\') name--;
+	len -= name - file;
+	object_names = realloc(object_names, ++object_names_count * sizeof(char *));
+	if(!object_names || !(object_names[object_names_count - 1] = malloc(len + 1))) {
+		perror(NULL);
+		abort();
+	}
+	memcpy(object_names[object_names_count - 1], name, len);
+	object_names[object_names_count - 1][len] = 0;
+}
 
-void add_input_file(char *file) {
+void add_input_file(const char *file, int no_warning) {
 	if(first_input_file) multiple_input_files = 1;
 	else first_input_file = file;
+	add_object_name(file);
+	input_file_names = realloc(input_file_names, (input_file_names_count + 1) * sizeof(char *));
+	if(!input_file_names) {
+		perror(NULL);
+		abort();
+	}
+	input_file_names[input_file_names_count++] = file;
+	if(last_language) typed_input_files = 1;
+	file = convert_path(file, no_warning);
 	if(last_language) {
 		char buffer[3 + strlen(file) + 1];
 		assert(strcmp(last_language, "c") == 0 || strcmp(last_language, "c++") == 0);
 		sprintf(buffer, "-T%c%s", last_language[1] ? 'p' : 'c', file);
 		add_to_argv(buffer);
 		last_language_unused = 0;
-		return;
-	}
-	if(*file == '/') *file = '\\';
-	add_to_argv(file);
+	} else add_to_argv(file);
+#ifndef _WIN32
+	input_file_argv_index = cl_argc - 1;
+#endif
 }
 
+/*	cl writes to a name of its own next to the target, which is renamed into
+	place at the end, so parallel invocations never see or clobber each
+	other's partial files.  When linking, the objects go to a directory of
+	their own too, rather than <source>.obj in the current directory.
+*/
 void set_output_file(const char *file, int no_link, int no_warning) {
-#if defined __INTERIX && !defined _NO_CONV_PATH
-	if(*file == '/') {
-		char buffer[3 + PATH_MAX + 1] = { '-', 'F', no_link ? 'o' : 'e' };
-		if(unixpath2win(file, 0, buffer + 3, sizeof buffer - 3) < 0) {
-			if(!no_warning) {
-				fprintf(stderr, "warning: cannot convert '%s' to Windows path name, %s\n", file, strerror(errno));
-			}
-			size_t len = strlen(file) + 1;
-			if(3 + len > sizeof buffer) {
-				fprintf(stderr, "error: %s: output file name too long\n", file);
-				exit(1);
-			}
-			memcpy(buffer + 3, file, len);
-		}
-		add_to_argv(buffer);
-	} else
-#endif
-	{
-		char buffer[3 + strlen(file) + 1];
-		sprintf(buffer, "-F%c%s", no_link ? 'o' : 'e', file);
-		add_to_argv(buffer);
-	}
+	temp_output = get_temp_name(file, no_link ? ".obj" : ".exe");
+	const char *windows_file = convert_path(temp_output, no_warning);
+	char buffer[3 + strlen(windows_file) + 1];
+	sprintf(buffer, "-F%c%s", no_link ? 'o' : 'e', windows_file);
+	add_to_argv(buffer);
 	target.name = file;
 	target.type = no_link ? OBJ : EXE;
+	if(no_link) return;
+	temp_object_directory = get_temp_name(file, ".d");
+	const char *windows_directory = convert_path(temp_object_directory, no_warning);
+	char directory_buffer[3 + strlen(windows_directory) + 1 + 1];
+	sprintf(directory_buffer, "-Fo%s\\", windows_directory);
+	add_to_argv(directory_buffer);
+	size_t len = strlen(file);
+	int n = get_last_dot(file, len);
+	if(n >= 0) len = n;
+	char base[len + 1];
+	memcpy(base, file, len);
+	base[len] = 0;
+	const char *windows_base = convert_path(base, no_warning);
+	// Inside the object directory, so a link that exports nothing leaves a library named after the target alone
+	const char *name = base + strlen(base);
+	while(name > base && name[-1] != '/' && name[-1] != '\\') name--;
+	import_library = malloc(strlen(temp_object_directory) + 1 + strlen(name) + 4 + 1);
+	if(!import_library) {
+		perror(NULL);
+		abort();
+	}
+	sprintf(import_library, "%s/%s.lib", temp_object_directory, name);
+	const char *windows_import_library = convert_path(import_library, no_warning);
+	char *pdb = malloc(5 + strlen(windows_base) + 4 + 1), *implib = malloc(8 + strlen(windows_import_library) + 1);
+	if(!pdb || !implib) {
+		perror(NULL);
+		abort();
+	}
+	sprintf(pdb, "-PDB:%s.pdb", windows_base);
+	sprintf(implib, "-IMPLIB:%s", windows_import_library);
+	add_link_option(pdb);
+	add_link_option(implib);
+}
+
+struct sort_item {
+	char *arg;
+	unsigned int position;
+};
+
+static int compare_defines(const void *a, const void *b) {
+	const struct sort_item *x = a, *y = b;
+	size_t x_len = strcspn(x->arg + 2, "=#"), y_len = strcspn(y->arg + 2, "=#");
+	int r = strncmp(x->arg + 2, y->arg + 2, x_len < y_len ? x_len : y_len);
+	if(!r) r = x_len < y_len ? -1 : x_len > y_len;
+	// Definitions of the same macro keep their order, so the last one still wins
+	return r ? r : x->position < y->position ? -1 : 1;
+}
+
+static int compare_disabled_warnings(const void *a, const void *b) {
+	const struct sort_item *x = a, *y = b;
+	unsigned int x_number = atoi(x->arg + 3), y_number = atoi(y->arg + 3);
+	if(x_number != y_number) return x_number < y_number ? -1 : 1;
+	return x->position < y->position ? -1 : 1;
+}
+
+static void sort_options(const char *prefix, int (*compare)(const void *, const void *)) {
+	size_t prefix_len = strlen(prefix);
+	struct sort_item items[cl_argc];
+	unsigned int count = 0, i;
+	for(i = 1; i < cl_argc && strcmp(cl_argv[i], "-link"); i++) {
+		if(strncmp(cl_argv[i], prefix, prefix_len) == 0) {
+			items[count].arg = cl_argv[i];
+			items[count].position = i;
+			count++;
+		}
+	}
+	if(count < 2) return;
+	unsigned int positions[count];
+	for(i = 0; i < count; i++) positions[i] = items[i].position;
+	qsort(items, count, sizeof *items, compare);
+	for(i = 0; i < count; i++) cl_argv[positions[i]] = items[i].arg;
+}
+
+/*	Puts the options whose order doesn't matter in a canonical order, each
+	set in the positions it already occupies, so equivalent command lines
+	are identical.  -D can't move across -U, and -I order is significant.
+*/
+static void canonicalize_argv() {
+	int i;
+	for(i = 1; i < cl_argc && strcmp(cl_argv[i], "-link"); i++) {
+		if(strncmp(cl_argv[i], "-U", 2) == 0) break;
+	}
+	if(i == cl_argc || strcmp(cl_argv[i], "-link") == 0) sort_options("-D", compare_defines);
+	sort_options("-wd", compare_disabled_warnings);
 }
 
 static int find_argv(char **v, const char *s) {
@@ -631,6 +2308,47 @@ static int find_argv(char **v, const char *s) {
 	return 0;
 }
 
+static void discover_toolchain(char **argv, int *no_warning) {
+	const char *vs_path = getenv("VS_PATH");
+	if(!vs_path) vs_path = getenv("VSINSTALLDIR");
+	if(!getenv("INCLUDE")) {
+		if(vs_path) {
+			size_t len = strlen(vs_path);
+			if(vs_path[len - 1] == '/' || vs_path[len - 1] == '\\') len--; 
+			char buffer[len + 12 + len + 24 + 1];
+			memcpy(buffer, vs_path, len);
+			memcpy(buffer + len, "/VC/include;", 12);
+			memcpy(buffer + len + 12, vs_path, len);
+			strcpy(buffer + len + 12 + len, "/VC/PlatformSDK/include;");
+			setenv("INCLUDE", buffer, 0);
+		} else {
+			*no_warning = find_argv(argv, "-w");
+			if(!*no_warning) fprintf(stderr, "%s: warning: no system include path set\n", argv[0]);
+		}
+	}
+	if(!getenv("LIB")) {
+		if(vs_path) {
+			size_t len = strlen(vs_path);
+			if(vs_path[len - 1] == '/' || vs_path[len - 1] == '\\') len--; 
+			char buffer[len + 8 + len + 20 + 1];
+			memcpy(buffer, vs_path, len);
+			memcpy(buffer + len, "/VC/lib;", 8);
+			memcpy(buffer + len + 8, vs_path, len);
+			strcpy(buffer + len + 8 + len, "/VC/PlatformSDK/lib;");
+			setenv("LIB", buffer, 0);
+		} else {
+			if(*no_warning == -1) *no_warning = find_argv(argv, "-w");
+			if(!*no_warning) fprintf(stderr, "%s: warning: no system library path set\n", argv[0]);
+		}
+	}
+}
+
+#ifdef CC2CL_BENCHMARK
+// bench/argbench.c times everything but running cl
+int benchmark_start_cl();
+#define start_cl benchmark_start_cl
+#endif
+
 int main(int argc, char **argv) {
 #define FIND_LONG_OPTION(ARRAY) \
 	{															\
@@ -677,39 +2395,16 @@ int main(int argc, char **argv) {
 	int end_of_options = 0;
 	const char *output_file = NULL;
 	char **v = argv;
+	stats_begin();
+	record_begin(RECORD_CC2CL, argc, argv);
 	init_argv();
 
-	const char *vs_path = getenv("VS_PATH");
-	if(!vs_path) vs_path = getenv("VSINSTALLDIR");
-	if(!getenv("INCLUDE")) {
-		if(vs_path) {
-			size_t len = strlen(vs_path);
-			if(vs_path[len - 1] == '/' || vs_path[len - 1] == '\\') len--; 
-			char buffer[len + 12 + len + 24 + 1];
-			memcpy(buffer, vs_path, len);
-			memcpy(buffer + len, "/VC/include;", 12);
-			memcpy(buffer + len + 12, vs_path, len);
-			strcpy(buffer + len + 12 + len, "/VC/PlatformSDK/include;");
-			setenv("INCLUDE", buffer, 0);
-		} else {
-			no_warning = find_argv(argv, "-w");
-			if(!no_warning) fprintf(stderr, "%s: warning: no system include path set\n", argv[0]);
-		}
-	}
-	if(!getenv("LIB")) {
-		if(vs_path) {
-			size_t len = strlen(vs_path);
-			if(vs_path[len - 1] == '/' || vs_path[len - 1] == '\\') len--; 
-			char buffer[len + 8 + len + 20 + 1];
-			memcpy(buffer, vs_path, len);
-			memcpy(buffer + len, "/VC/lib;", 8);
-			memcpy(buffer + len + 12, vs_path, len);
-			strcpy(buffer + len + 12 + len, "/VC/PlatformSDK/lib;");
-			setenv("LIB", buffer, 0);
-		} else {
-			if(no_warning == -1) no_warning = find_argv(argv, "-w");
-			if(!no_warning) fprintf(stderr, "%s: warning: no system library path set\n", argv[0]);
-		}
+	snapshot_key = get_snapshot_key();
+	if(find_argv(argv, "--snapshot") || load_snapshot() < 0) discover_toolchain(argv, &no_warning);
+	else {
+		if(snapshot.include) setenv("INCLUDE", snapshot.include, 1);
+		if(snapshot.lib) setenv("LIB", snapshot.lib, 1);
+		if(snapshot.path) setenv("PATH", snapshot.path, 1);
 	}
 
 first_loop:
@@ -941,22 +2636,8 @@ first_loop:
 			}
 		} else {
 not_an_option:
-#if defined __INTERIX && !defined _NO_CONV_PATH
-			if(**v == '/') {
-				char buffer[PATH_MAX + 1];
-				if(unixpath2win(*v, 0, buffer, sizeof buffer) == 0) {
-					add_input_file(buffer);
-				} else {
-					if(no_warning == -1) no_warning = find_argv(argv, "-w");
-					if(!no_warning) {
-						fprintf(stderr, "%s: warning: cannot convert '%s' to Windows path name, %s\n",
-							argv[0], *v, strerror(errno));
-					}
-					add_input_file(*v);
-				}
-			} else
-#endif
-			add_input_file(*v);
+			if(no_warning == -1) no_warning = find_argv(argv, "-w");
+			add_input_file(*v, no_warning);
 		}
 	}
 	setvbuf(stdout, NULL, _IOLBF, 0);
@@ -979,11 +2660,16 @@ not_an_option:
 			fprintf(stderr, "%s: error: cannot specify -o with -c or -E with multiple files\n", argv[0]);
 			return 4;
 		} else if(no_link) {
-			fprintf(stderr, "%s: error: '-c' with multiple files is currently not supported\n", argv[0]);
-			return -1;
+			// Every extra cl worker needs a jobserver token
+			unsigned int jobs = 1 + jobserver_acquire(object_names_count - 1);
+			if(jobs > 1) {
+				char buffer[3 + 10 + 1];
+				sprintf(buffer, "-MP%u", jobs);
+				add_to_argv(buffer);
+			}
 		}
 	}
-	if(!output_file && !preprocess_only) {
+	if(!output_file && !preprocess_only && !(multiple_input_files && no_link)) {
 		if(no_link) {
 			size_t len = strlen(first_input_file);
 			int n = get_last_dot(first_input_file, len);
@@ -1002,10 +2688,42 @@ not_an_option:
 	if(preprocess_only) {
 		if(output_file) target.name = output_file;
 		target.type = PREPROCESSED_SOURCE;
-	} else set_output_file(output_file, no_link, no_warning);
+	} else if(multiple_input_files && no_link) target.type = OBJ;
+	else set_output_file(output_file, no_link, no_warning);
+	if(lto_jobs && !no_link && !preprocess_only) {
+		add_link_option("-LTCG");
+		int jobs = lto_jobs == LTO_JOBSERVER ? 1 + jobserver_acquire(7) : lto_jobs;
+		if(jobs > 1) {
+			static char buffer[12 + 10 + 1];
+			sprintf(buffer, "-CGTHREADS:%d", jobs < 8 ? jobs : 8);
+			add_link_option(buffer);
+		}
+	}
+	if(reproducible && !no_link && !preprocess_only) add_link_option("-Brepro");
 	//if(no_static_link) add_to_argv("-MD");
 	add_to_argv(no_static_link ? "-MD" : "-MT");
+	add_search_paths_to_argv(verbose);
+	if(!no_link && !preprocess_only && resolve_libraries(argv[0]) < 0) return 1;
 	add_libraries_to_argv();
+	if(reproducible) canonicalize_argv();
 	if(verbose) print_argv();
-	return start_cl();
+	struct linkcache cache;
+	linkcache_begin(&cache);
+	if(cache.mode && target.type == EXE && add_link_to_cache(&cache, argv) == 0) {
+		if(linkcache_is_up_to_date(&cache, target.name)) {
+			if(verbose) fprintf(stderr, "%s: %s is up to date\n", argv[0], target.name);
+			jobserver_release();
+			stats_end(STATS_CC2CL, 0, target.name);
+			record_end(0);
+			return 0;
+		}
+	} else cache.mode = 0;
+	int r = start_cl();
+	if(!r && cache.mode) linkcache_commit(&cache, target.name);
+	stats_end(STATS_CC2CL, r, target.name);
+	record_end(r);
+#ifndef _WIN32
+	children_resend_signal();
+#endif
+	return r;
 }
@@ -0,0 +1,151 @@
+/*	Child process tracking shared by cc2cl and cl2cc
+	Copyright 2015 libdll.so
+
+	This program is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation; either version 2 of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+*/
+
+/*
+	No compiler started by a wrapper may outlive it.  On POSIX every child
+	runs in a process group of its own; SIGINT, SIGTERM and SIGHUP sent to
+	the wrapper are forwarded to the groups of all running children, and
+	on Linux a child also gets SIGTERM if the wrapper dies without handling
+	anything.  Once the children are reaped and the temporary files are
+	cleaned up, the wrapper kills itself with the same signal, so make sees
+	how it ended.  On Windows the children are put in a job object that is
+	killed when the wrapper's last handle to it goes away.
+
+	The forwarding signal interrupts the wait for the child, so the wrapper
+	reacts as soon as the child is gone without needing a pidfd.
+*/
+
+#ifndef _CHILDREN_H
+#define _CHILDREN_H
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <signal.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+
+#ifdef _WIN32
+static void *children_job;
+
+// Call with a process created suspended, then resume it
+static inline void child_add(void *process) {
+	if(!children_job) {
+		JOBOBJECT_EXTENDED_LIMIT_INFORMATION info = { .BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE };
+		children_job = CreateJobObjectA(NULL, NULL);
+		if(!children_job) return;
+		if(!SetInformationJobObject(children_job, JobObjectExtendedLimitInformation, &info, sizeof info)) {
+			CloseHandle(children_job);
+			children_job = NULL;
+			return;
+		}
+	}
+	// Fails before Windows 8 if the wrapper itself runs in a job
+	AssignProcessToJobObject(children_job, process);
+}
+#else
+#define CHILDREN_MAX 256
+
+static const int children_signals[] = { SIGINT, SIGTERM, SIGHUP };
+static pid_t children[CHILDREN_MAX];
+static volatile sig_atomic_t children_count;
+static volatile sig_atomic_t children_received_signal;
+static pid_t children_parent;
+static sigset_t children_old_mask;
+
+static inline void children_signal_handler(int sig) {
+	int i;
+	children_received_signal = sig;
+	for(i = 0; i < children_count; i++) if(children[i] > 0) kill(-children[i], sig);
+}
+
+// Call before fork, so a signal can't come before the child is known
+static inline void children_block_signals() {
+	static int installed;
+	sigset_t set;
+	unsigned int i;
+	sigemptyset(&set);
+	for(i = 0; i < sizeof children_signals / sizeof *children_signals; i++) sigaddset(&set, children_signals[i]);
+	sigprocmask(SIG_BLOCK, &set, &children_old_mask);
+	children_parent = getpid();
+	if(installed) return;
+	installed = 1;
+	struct sigaction action = { .sa_handler = children_signal_handler };
+	sigemptyset(&action.sa_mask);
+	for(i = 0; i < sizeof children_signals / sizeof *children_signals; i++) {
+		struct sigaction old_action;
+		// Keep a signal ignored if it was ignored, as for nohup
+		if(sigaction(children_signals[i], NULL, &old_action) == 0 && old_action.sa_handler == SIG_IGN) continue;
+		sigaction(children_signals[i], &action, NULL);
+	}
+}
+
+// Call in the child between fork and exec
+static inline void child_setup() {
+	unsigned int i;
+	for(i = 0; i < sizeof children_signals / sizeof *children_signals; i++) {
+		struct sigaction old_action;
+		if(sigaction(children_signals[i], NULL, &old_action) == 0 && old_action.sa_handler == children_signal_handler) {
+			signal(children_signals[i], SIG_DFL);
+		}
+	}
+	setpgid(0, 0);
+#ifdef __linux__
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	// The parent may be gone already
+	if(getppid() != children_parent) _exit(127);
+#endif
+	sigprocmask(SIG_SETMASK, &children_old_mask, NULL);
+}
+
+// Call in the parent after fork, also when it failed
+static inline void child_add(pid_t pid) {
+	if(pid > 0) {
+		// Also done here, so no signal can find the child still in our group
+		setpgid(pid, pid);
+		if(children_count < CHILDREN_MAX) children[children_count++] = pid;
+		if(children_received_signal) kill(-pid, children_received_signal);
+	}
+	sigprocmask(SIG_SETMASK, &children_old_mask, NULL);
+}
+
+// Call after the child is reaped
+static inline void child_remove(pid_t pid) {
+	sigset_t set, old_set;
+	unsigned int i;
+	sigemptyset(&set);
+	for(i = 0; i < sizeof children_signals / sizeof *children_signals; i++) sigaddset(&set, children_signals[i]);
+	sigprocmask(SIG_BLOCK, &set, &old_set);
+	for(i = 0; i < children_count; i++) if(children[i] == pid) break;
+	if(i < children_count) {
+		children[i] = children[children_count - 1];
+		children_count--;
+	}
+	sigprocmask(SIG_SETMASK, &old_set, NULL);
+}
+
+// Ends the process with the signal it was sent while waiting for a child, if any
+static inline void children_resend_signal() {
+	int sig = children_received_signal;
+	if(!sig) return;
+	signal(sig, SIG_DFL);
+	raise(sig);
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, sig);
+	sigprocmask(SIG_UNBLOCK, &set, NULL);
+}
+#endif
+
+#endif
@@ -6,35 +6,59 @@
 	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
 */
 
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
 #include <limits.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <ctype.h>
 #include <assert.h>
+#include "stats.h"
+#include "record.h"
+#include "jobserver.h"
+#include "children.h"
+#include "respfile.h"
 
 #define VERSION "1.0"
 
-static char *cc_command_line;
-static unsigned int cc_command_line_length;
-static unsigned int cc_command_line_max_length;
+#ifndef _WIN32
+extern char **environ;
+#endif
+
+// The translated command; the command line is only built for CreateProcessA
+static char **cc_argv;
+static unsigned int cc_argc;
+static unsigned int cc_argv_max_count;
 
 static void __attribute__((__noreturn__)) fatal(int e) {
 	assert(e);
+#ifdef _WIN32
 	MessageBoxA(NULL, strerror(e), NULL, MB_ICONHAND);
+#else
+	fprintf(stderr, "cl2cc: %s\n", strerror(e));
+#endif
 	exit(-e);
 }
 
 void init_command_line() {
-	cc_command_line_max_length = PATH_MAX * 2 + 1; 
-	cc_command_line = malloc(cc_command_line_max_length);
-	if(!cc_command_line) fatal(ENOMEM);
+	cc_argv_max_count = 64;
+	cc_argv = malloc(cc_argv_max_count * sizeof(char *));
+	if(!cc_argv) fatal(ENOMEM);
 	const char *cc = getenv("CC");
 	if(!cc) cc = "cc";
-	size_t len = strlen(cc);
-	strcpy(cc_command_line, cc);
-	cc_command_line_length = len;
+	cc_argv[0] = (char *)cc;
+	cc_argv[1] = NULL;
+	cc_argc = 1;
 }
 
 static int have_space(const char *s) {
@@ -46,25 +70,24 @@ static int have_space(const char *s) {
 }
 
 void add_arg(const char *arg) {
-	size_t len = strlen(arg) + 1;
-	//if(have_space(arg)) len += 2;
-	int need_quote = have_space(arg);
-	//if(need_quote) len += 2;
-	if(cc_command_line_length + len + need_quote ? 2 : 0 > cc_command_line_max_length) {
-		cc_command_line_max_length += PATH_MAX;
-		cc_command_line = realloc(cc_command_line, cc_command_line_max_length);
-		if(!cc_command_line) fatal(ENOMEM);
+	if(cc_argc + 1 >= cc_argv_max_count) {
+		cc_argv_max_count *= 2;
+		cc_argv = realloc(cc_argv, cc_argv_max_count * sizeof(char *));
+		if(!cc_argv) fatal(ENOMEM);
 	}
-	cc_command_line[cc_command_line_length] = ' ';
-	if(need_quote) cc_command_line[++cc_command_line_length] = '\"';
-	memcpy(cc_command_line + cc_command_line_length + 1, arg, len);
-	cc_command_line_length += len;
-	if(need_quote) {
-		cc_command_line[cc_command_line_length++] = '\"';
-		cc_command_line[cc_command_line_length] = 0;
+	if(!(cc_argv[cc_argc] = strdup(arg))) fatal(ENOMEM);
+	cc_argv[++cc_argc] = NULL;
+}
+
+void print_command_line(char **v) {
+	while(*v) {
+		printf(have_space(*v) ? "\"%s\"" : "%s", *v);
+		if(*++v) putchar(' ');
 	}
+	putchar('\n');
 }
 
+
 static int get_last_dot(const char *s, size_t len) {
 	while(--len) {
 		if(s[len] == '.') break;
@@ -81,29 +104,328 @@ static int get_file_name(const char *s, size_t len) {
 	return len ? len + 1 : 0;
 }
 
-int start_cc() {
+static int file_exists(const char *file) {
+#ifdef _WIN32
+	return GetFileAttributesA(file) != INVALID_FILE_ATTRIBUTES;
+#else
+	return access(file, F_OK) == 0;
+#endif
+}
+
+/*	/showIncludes is -H, whose list of headers on the standard error of cc
+	becomes the notes of cl on our standard output, nested the same way:
+
+		. a.h				Note: including file: a.h
+		.. b.h				Note: including file:  b.h
+		! stdafx.pch.gch		Note: including file: stdafx.pch.gch
+
+	A precompiled header stands for every header in it.  The invalid ones
+	and the list of headers that may want include guards are dropped;
+	everything else cc prints goes to our standard output with the notes,
+	where cl prints its diagnostics.
+*/
+static int show_includes;
+
+struct include_filter {
+	char *line;
+	size_t len, max_len;
+	int guards;		// In the list after "Multiple include guards may be useful for:"
+};
+
+static void filter_line(struct include_filter *filter) {
+	char *line = filter->line;
+	size_t len = filter->len, depth = 0;
+	if(len && line[len - 1] == '\r') len--;
+	line[len] = 0;
+	while(line[depth] == '.') depth++;
+	if(depth && line[depth] == ' ') {
+		printf("Note: including file:%*s%s\n", (int)depth, "", line + depth + 1);
+		return;
+	}
+	if(line[0] == '!' && line[1] == ' ') {
+		printf("Note: including file: %s\n", line + 2);
+		return;
+	}
+	if(line[0] == 'x' && line[1] == ' ' && file_exists(line + 2)) return;
+	if(strcmp(line, "Multiple include guards may be useful for:") == 0) {
+		filter->guards = 1;
+		return;
+	}
+	if(filter->guards) {
+		if(file_exists(line)) return;
+		filter->guards = 0;
+	}
+	puts(line);
+}
+
+static void filter_output(struct include_filter *filter, const char *data, size_t len) {
+	while(len) {
+		const char *eol = memchr(data, '\n', len);
+		size_t n = eol ? (size_t)(eol - data) : len;
+		if(filter->len + n + 1 > filter->max_len) {
+			filter->max_len = filter->max_len * 2 > filter->len + n + 1 ? filter->max_len * 2 : filter->len + n + 1;
+			filter->line = realloc(filter->line, filter->max_len);
+			if(!filter->line) fatal(ENOMEM);
+		}
+		memcpy(filter->line + filter->len, data, n);
+		filter->len += n;
+		if(!eol) break;
+		filter_line(filter);
+		filter->len = 0;
+		data += n + 1;
+		len -= n + 1;
+	}
+	fflush(stdout);
+}
+
+static void filter_end(struct include_filter *filter) {
+	if(filter->len) filter_line(filter);
+	free(filter->line);
+	fflush(stdout);
+}
+
+#ifdef _WIN32
+// Starts argv with its output going to output, or ours if NULL; returns the process, NULL on error
+static void *spawn_cc(char **argv, void *output) {
 	const char *compiler = getenv("CC_LOCATION");
 	STARTUPINFOA si = { .cb = sizeof(STARTUPINFOA) };
 	PROCESS_INFORMATION pi;
-	while(!CreateProcessA(compiler, cc_command_line, NULL, NULL, 0, 0, NULL, NULL, &si, &pi)) {
+	char *command_line = respfile_join(argv);
+	if(output) {
+		si.dwFlags = STARTF_USESTDHANDLES;
+		si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+		si.hStdOutput = si.hStdError = output;
+	}
+	while(!CreateProcessA(compiler, command_line, NULL, NULL, output != NULL, CREATE_SUSPENDED, NULL, NULL, &si, &pi)) {
 		if(compiler) {
 			compiler = NULL;
 			continue;
 		}
 		fprintf(stderr, "CreateProcessA failed, error %lu\n", GetLastError());
-		exit(127);
+		free(command_line);
+		return NULL;
 	}
+	free(command_line);
+	child_add(pi.hProcess);
+	ResumeThread(pi.hThread);
+	CloseHandle(pi.hThread);
+	return pi.hProcess;
+}
+
+static int get_exit_code(void *process) {
 	unsigned long int r;
-	if(WaitForSingleObject(pi.hProcess, INFINITE) == 0xffffffff) {
+	if(!GetExitCodeProcess(process, &r)) {
 		unsigned long int e = GetLastError();
-		fprintf(stderr, "WaitForSingleObject failed, error %lu\n", e);
-		return -e;
+		fprintf(stderr, "GetExitCodeProcess failed, error %lu\n", e);
+		r = -e;
+	}
+	CloseHandle(process);
+	return r;
+}
+
+static void *create_capture_file() {
+	char directory[PATH_MAX + 1], name[PATH_MAX + 1];
+	if(!GetTempPathA(sizeof directory, directory) || !GetTempFileNameA(directory, "cc", 0, name)) return NULL;
+	SECURITY_ATTRIBUTES security_attr = {
+		.nLength = sizeof(SECURITY_ATTRIBUTES),
+		.lpSecurityDescriptor = NULL,
+		.bInheritHandle = 1
+	};
+	void *fh = CreateFileA(name, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, &security_attr,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+	return fh == INVALID_HANDLE_VALUE ? NULL : fh;
+}
+
+// Reads the output of cc from fh, for /showIncludes, and closes it
+static void write_filtered_output(void *fh) {
+	struct include_filter filter = { NULL, 0, 0, 0 };
+	char buffer[4096];
+	unsigned long int read_size;
+	while(ReadFile(fh, buffer, sizeof buffer, &read_size, NULL) && read_size) {
+		filter_output(&filter, buffer, read_size);
+	}
+	filter_end(&filter);
+	CloseHandle(fh);
+}
+
+// Copies what was written to the file to our standard output and closes it
+static void write_captured_output(void *fh) {
+	char buffer[4096];
+	unsigned long int read_size, written;
+	SetFilePointer(fh, 0, NULL, FILE_BEGIN);
+	if(show_includes) {
+		write_filtered_output(fh);
+		return;
+	}
+	while(ReadFile(fh, buffer, sizeof buffer, &read_size, NULL) && read_size) {
+		WriteFile(GetStdHandle(STD_OUTPUT_HANDLE), buffer, read_size, &written, NULL);
+	}
+	CloseHandle(fh);
+}
+#else
+// Starts argv with its output going to output_fd, or ours if -1; returns the pid, -1 on error
+static pid_t spawn_cc(char **argv, int output_fd) {
+	/*	Without a fork, the child can't run child_setup(); posix_spawn puts
+		it in a group of its own and restores the signals instead, but
+		there is no parent death signal.
+	*/
+	const char *compiler = getenv("CC_LOCATION");
+	posix_spawnattr_t attr;
+	posix_spawn_file_actions_t file_actions;
+	sigset_t default_signals;
+	pid_t pid;
+	int e;
+	sigemptyset(&default_signals);
+	sigaddset(&default_signals, SIGINT);
+	sigaddset(&default_signals, SIGTERM);
+	sigaddset(&default_signals, SIGHUP);
+	if((e = posix_spawnattr_init(&attr)) || (e = posix_spawn_file_actions_init(&file_actions))) fatal(e);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+	posix_spawnattr_setpgroup(&attr, 0);
+	posix_spawnattr_setsigdefault(&attr, &default_signals);
+	if(output_fd != -1) {
+		posix_spawn_file_actions_adddup2(&file_actions, output_fd, 1);
+		posix_spawn_file_actions_adddup2(&file_actions, output_fd, 2);
+	}
+	children_block_signals();
+	posix_spawnattr_setsigmask(&attr, &children_old_mask);
+	while((e = posix_spawnp(&pid, compiler ? compiler : argv[0], &file_actions, &attr, argv, environ))) {
+		if(compiler) {
+			compiler = NULL;
+			continue;
+		}
+		fprintf(stderr, "cannot run %s, %s\n", argv[0], strerror(e));
+		pid = -1;
+		break;
+	}
+	child_add(pid);
+	posix_spawn_file_actions_destroy(&file_actions);
+	posix_spawnattr_destroy(&attr);
+	return pid;
+}
+
+// Waits for the child, or any child if pid is -1
+static pid_t wait_cc(pid_t pid, int *status) {
+	pid_t r;
+	while((r = waitpid(pid, status, 0)) < 0) {
+		if(errno != EINTR) {
+			perror("waitpid");
+			return -1;
+		}
+	}
+	child_remove(r);
+	return r;
+}
+
+static int get_exit_code(int status, const char *name) {
+	if(WIFSIGNALED(status)) {
+		fprintf(stderr, "%s terminated with signal %d\n", name, WTERMSIG(status));
+		return WTERMSIG(status) + 126;
+	}
+	return WEXITSTATUS(status);
+}
+
+static int create_capture_file() {
+	FILE *f = tmpfile();
+	if(!f) return -1;
+	int fd = dup(fileno(f));
+	fclose(f);
+	return fd;
+}
+
+// Reads the output of cc from fd, for /showIncludes, and closes it
+static void write_filtered_output(int fd) {
+	struct include_filter filter = { NULL, 0, 0, 0 };
+	char buffer[4096];
+	ssize_t s;
+	while((s = read(fd, buffer, sizeof buffer)) != 0) {
+		if(s < 0) {
+			if(errno == EINTR) continue;
+			break;
+		}
+		filter_output(&filter, buffer, s);
+	}
+	filter_end(&filter);
+	close(fd);
+}
+
+// Copies what was written to the file to our standard output and closes it
+static void write_captured_output(int fd) {
+	char buffer[4096];
+	ssize_t s;
+	off_t offset = 0;
+	if(show_includes) {
+		lseek(fd, 0, SEEK_SET);
+		write_filtered_output(fd);
+		return;
+	}
+	while((s = pread(fd, buffer, sizeof buffer, offset)) > 0) {
+		offset += s;
+		char *p = buffer;
+		while(s > 0) {
+			ssize_t w = write(1, p, s);
+			if(w < 0) {
+				if(errno == EINTR) continue;
+				break;
+			}
+			p += w;
+			s -= w;
+		}
 	}
-	if(!GetExitCodeProcess(pi.hProcess, &r)) {
+	close(fd);
+}
+#endif
+
+int start_cc(char **argv) {
+	fflush(stdout);
+	stats_compile_begin();
+#ifdef _WIN32
+	// With /showIncludes, the output comes through a pipe
+	void *read_end = NULL, *write_end = NULL;
+	if(show_includes) {
+		SECURITY_ATTRIBUTES security_attr = {
+			.nLength = sizeof(SECURITY_ATTRIBUTES),
+			.lpSecurityDescriptor = NULL,
+			.bInheritHandle = 1
+		};
+		if(!CreatePipe(&read_end, &write_end, &security_attr, 0)) {
+			fprintf(stderr, "CreatePipe failed, error %lu\n", GetLastError());
+			exit(127);
+		}
+		SetHandleInformation(read_end, HANDLE_FLAG_INHERIT, 0);
+	}
+	void *process = spawn_cc(argv, write_end);
+	if(!process) exit(127);
+	if(show_includes) {
+		CloseHandle(write_end);
+		write_filtered_output(read_end);
+	}
+	if(WaitForSingleObject(process, INFINITE) == 0xffffffff) {
 		unsigned long int e = GetLastError();
-		fprintf(stderr, "GetExitCodeProcess failed, error %lu\n", e);
+		fprintf(stderr, "WaitForSingleObject failed, error %lu\n", e);
 		return -e;
 	}
+	int r = get_exit_code(process);
+#else
+	int status, fds[2] = { -1, -1 };
+	if(show_includes) {
+		if(pipe(fds) < 0) {
+			perror("pipe");
+			exit(127);
+		}
+		fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+		fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	}
+	pid_t pid = spawn_cc(argv, fds[1]);
+	if(pid == -1) exit(127);
+	if(show_includes) {
+		close(fds[1]);
+		write_filtered_output(fds[0]);
+	}
+	if(wait_cc(pid, &status) < 0) return -errno;
+	int r = get_exit_code(status, argv[0]);
+#endif
+	stats_compile_end();
 
 	return r;
 }
@@ -165,11 +487,98 @@ void add_library(const char *lib) {
 	add_arg(buffer);
 }
 
+static unsigned int get_processor_count() {
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#else
+	long int n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+#endif
+}
+
+// The link of /LTCG runs its partitions on the jobserver of make, or on every processor
+static void add_lto_arg() {
+	char *auth = jobserver_get_auth();
+	if(auth) {
+		free(auth);
+		add_arg("-flto=jobserver");
+		return;
+	}
+	char buffer[6 + 10 + 1];
+	sprintf(buffer, "-flto=%u", get_processor_count());
+	add_arg(buffer);
+}
+
+/*	/GENPROFILE and /USEPROFILE; cc keeps the profile of every object in
+	a directory, named after the PGD file with .pgo in place of .pgd, or
+	next to the objects without a PGD file.
+*/
+#define PROFILE_GENERATE 1
+#define PROFILE_USE 2
+static int profile;
+static const char *profile_database;
+
+// Takes PGD= from the comma separated arguments of /GENPROFILE or /USEPROFILE
+static void set_profile_database(const char *a) {
+	while(*a) {
+		size_t len = strcspn(a, ",");
+		if(strncasecmp(a, "pgd=", 4) == 0 && len > 4) {
+			char *p = malloc(len - 4 + 1);
+			if(!p) fatal(ENOMEM);
+			memcpy(p, a + 4, len - 4);
+			p[len - 4] = 0;
+			profile_database = p;
+		}
+		a += len;
+		if(*a) a++;
+	}
+}
+
+static void add_profile_arg() {
+	const char *option = profile == PROFILE_GENERATE ? "-fprofile-generate" : "-fprofile-use";
+	if(!profile_database) {
+		add_arg(option);
+		return;
+	}
+	size_t len = strlen(profile_database);
+	int n = get_last_dot(profile_database, len);
+	if(n >= 0) len = n;
+	char buffer[strlen(option) + 1 + len + 4 + 1];
+	sprintf(buffer, "%s=%.*s.pgo", option, (int)len, profile_database);
+	add_arg(buffer);
+}
+
 static const char *first_input_file;
 
-void add_input_file(const char *file) {
+struct input_file {
+	const char *name;
+	unsigned int index;		// Of the name in cc_argv
+	const char *language;		// The -x option before it, for /Tc and /Tp
+	const char *quote_directory;	// For -iquote, when cc_argv has a copy of the source in another directory
+};
+
+static struct input_file *input_files;
+static unsigned int input_files_count;
+static unsigned int mp_jobs;		// From /MP, 0 without it
+
+static void add_typed_input_file(const char *file, const char *language) {
 	if(!first_input_file) first_input_file = file;
+	input_files = realloc(input_files, (input_files_count + 1) * sizeof *input_files);
+	if(!input_files) fatal(ENOMEM);
+	if(language) add_arg(language);
+	input_files[input_files_count].name = file;
+	input_files[input_files_count].index = cc_argc;
+	input_files[input_files_count].language = language;
+	input_files[input_files_count].quote_directory = NULL;
+	input_files_count++;
 	add_arg(file);
+	if(language) add_arg("-xnone");
+}
+
+void add_input_file(const char *file) {
+	add_typed_input_file(file, NULL);
 }
 
 void set_output_file(const char *file) {
@@ -177,6 +586,570 @@ void set_output_file(const char *file) {
 	add_arg(file);
 }
 
+static int is_directory_name(const char *s) {
+	size_t len = strlen(s);
+	return len && (s[len - 1] == '/' || s[len - 1] == '\\');
+}
+
+// <directory><source without its directory and extension><suffix>
+static char *get_output_name(const char *directory, const char *source, const char *suffix) {
+	size_t directory_len = directory ? strlen(directory) : 0;
+	size_t len = strlen(source);
+	int n1 = get_file_name(source, len);
+	int n2 = get_last_dot(source, len);
+	if(n2 >= 0) len = n2;
+	if(n1 > 0) {
+		assert(n1 < len);
+		source += n1;
+		len -= n1;
+	}
+	char *p = malloc(directory_len + len + strlen(suffix) + 1);
+	if(!p) fatal(ENOMEM);
+	memcpy(p, directory, directory_len);
+	memcpy(p + directory_len, source, len);
+	strcpy(p + directory_len + len, suffix);
+#ifndef _WIN32
+	if(directory_len && p[directory_len - 1] == '\\') p[directory_len - 1] = '/';
+#endif
+	return p;
+}
+
+// Fills options with cc_argv without the sources and their -x options; returns how many
+static unsigned int get_options(char **options) {
+	char source[cc_argc];
+	unsigned int count = 0, i;
+	memset(source, 0, cc_argc);
+	for(i = 0; i < input_files_count; i++) {
+		unsigned int index = input_files[i].index;
+		source[index] = 1;
+		if(input_files[i].language) source[index - 1] = source[index + 1] = 1;
+	}
+	for(i = 0; i < cc_argc; i++) if(!source[i]) options[count++] = cc_argv[i];
+	options[count] = NULL;
+	return count;
+}
+
+/*	With several sources and /c, every source is compiled by a cc of its
+	own, up to mp_jobs at once; each job beyond the first takes a token
+	when make's jobserver is around.  The output of a job is held back
+	until it ends, so the diagnostics of different sources never mix.
+	As with cl, a source that fails doesn't stop the others; only a cc
+	that can't be started does.  The first failure is returned.
+*/
+#ifdef _WIN32
+#define MAX_JOBS MAXIMUM_WAIT_OBJECTS
+#else
+#define MAX_JOBS CHILDREN_MAX
+#endif
+
+struct job {
+	char **argv;
+	char *object;
+#ifdef _WIN32
+	void *process;
+	void *output;
+#else
+	pid_t pid;
+	int output;
+#endif
+};
+
+static int start_jobs(const char *directory) {
+	unsigned int jobs = mp_jobs ? mp_jobs : 1, running = 0, next = 0, i;
+	int r = 0, spawn_failed = 0;
+	if(jobs > input_files_count) jobs = input_files_count;
+	if(jobs > MAX_JOBS) jobs = MAX_JOBS;
+	char *auth = jobserver_get_auth();
+	if(auth && jobs > 1) jobs = 1 + jobserver_acquire(jobs - 1);
+	free(auth);
+
+	// A job adds its own source to the options, and -o
+	char *base[cc_argc + 1];
+	unsigned int base_count = get_options(base);
+
+	struct job running_jobs[jobs];
+	fflush(stdout);
+	stats_compile_begin();
+	while((next < input_files_count && !spawn_failed) || running) {
+		while(next < input_files_count && running < jobs && !spawn_failed) {
+			const struct input_file *input = input_files + next++;
+			struct job *job = running_jobs + running;
+			char **argv = malloc((base_count + 8) * sizeof(char *)), **p = argv;
+			if(!argv) fatal(ENOMEM);
+			memcpy(p, base, base_count * sizeof(char *));
+			p += base_count;
+			if(input->quote_directory) {
+				*p++ = "-iquote";
+				*p++ = (char *)input->quote_directory;
+			}
+			if(input->language) *p++ = (char *)input->language;
+			*p++ = cc_argv[input->index];
+			if(input->language) *p++ = "-xnone";
+			*p++ = "-o";
+			*p++ = job->object = get_output_name(directory, input->name, ".obj");
+			*p = NULL;
+			job->argv = argv;
+			job->output = create_capture_file();
+			print_command_line(argv);
+			fflush(stdout);
+#ifdef _WIN32
+			if(!(job->process = spawn_cc(argv, job->output))) {
+#else
+			if((job->pid = spawn_cc(argv, job->output)) == -1) {
+#endif
+#ifdef _WIN32
+				if(job->output) write_captured_output(job->output);
+#else
+				if(job->output != -1) write_captured_output(job->output);
+#endif
+				free(job->object);
+				free(argv);
+				if(!r) r = 127;
+				spawn_failed = 1;
+				break;
+			}
+			running++;
+		}
+		if(!running) break;
+
+		// Wait for whichever job ends first
+		int status;
+#ifdef _WIN32
+		void *processes[running];
+		for(i = 0; i < running; i++) processes[i] = running_jobs[i].process;
+		unsigned long int w = WaitForMultipleObjects(running, processes, 0, INFINITE);
+		if(w >= WAIT_OBJECT_0 + running) {
+			fprintf(stderr, "WaitForMultipleObjects failed, error %lu\n", GetLastError());
+			exit(127);
+		}
+		i = w - WAIT_OBJECT_0;
+		status = get_exit_code(running_jobs[i].process);
+#else
+		pid_t pid = wait_cc(-1, &status);
+		if(pid == -1) exit(127);
+		for(i = 0; i < running; i++) if(running_jobs[i].pid == pid) break;
+		if(i == running) continue;
+		status = get_exit_code(status, running_jobs[i].argv[0]);
+#endif
+		struct job *job = running_jobs + i;
+#ifdef _WIN32
+		if(job->output) write_captured_output(job->output);
+#else
+		if(job->output != -1) write_captured_output(job->output);
+#endif
+		if(status && !r) r = status;
+		free(job->object);
+		free(job->argv);
+		*job = running_jobs[--running];
+	}
+	stats_compile_end();
+	jobserver_release();
+	return r;
+}
+
+/*	Precompiled headers.  /Yc<header> compiles the header into <pch>.gch,
+	with the options of the source, and writes <pch> itself as a header
+	that includes the original, for cc to read when the .gch can't be used;
+	<pch> is the /Fp file, or named after the source for /Yc and after the
+	header for /Yu, as cl does.  Every source is then compiled as with
+	/Yu<header>: with -include <pch>, and without the lines up to its
+	#include of the header, which cl skips too.  cc is given a copy of
+	the source without them, in a temporary directory of its own, with
+	#line for the diagnostics and -iquote for the includes that follow.
+*/
+static const char *pch_create, *pch_use, *pch_file;
+static int pch_disabled;		// /Y-
+static char **temporary_files;
+static unsigned int temporary_files_count;
+
+static void add_temporary_file(char *file) {
+	temporary_files = realloc(temporary_files, (temporary_files_count + 1) * sizeof(char *));
+	if(!temporary_files) fatal(ENOMEM);
+	temporary_files[temporary_files_count++] = file;
+}
+
+// The last one first, so the directories are empty
+static void remove_temporary_files() {
+	while(temporary_files_count) {
+		char *file = temporary_files[--temporary_files_count];
+#ifdef _WIN32
+		if(remove(file) < 0) RemoveDirectoryA(file);
+#else
+		remove(file);
+#endif
+		free(file);
+	}
+}
+
+static char *make_temporary_directory() {
+#ifdef _WIN32
+	char directory[PATH_MAX + 1], name[PATH_MAX + 1];
+	if(!GetTempPathA(sizeof directory, directory) || !GetTempFileNameA(directory, "cc", 0, name)) return NULL;
+	// GetTempFileNameA created a file to reserve the name
+	if(!DeleteFileA(name) || !CreateDirectoryA(name, NULL)) return NULL;
+	char *p = strdup(name);
+	if(!p) fatal(ENOMEM);
+#else
+	const char *directory = getenv("TMPDIR");
+	if(!directory || !*directory) directory = "/tmp";
+	char *p = malloc(strlen(directory) + 13);
+	if(!p) fatal(ENOMEM);
+	strcpy(p, directory);
+	strcat(p, "/cl2ccXXXXXX");
+	if(!mkdtemp(p)) {
+		free(p);
+		return NULL;
+	}
+#endif
+	add_temporary_file(p);
+	return p;
+}
+
+// Looks for header as cl would for #include "header" in source, and returns its full path
+static char *find_header(const char *header, const char *source) {
+	char buffer[PATH_MAX + 1];
+	size_t header_len = strlen(header);
+	const char *directory = source;
+	size_t directory_len = get_file_name(source, strlen(source));
+	unsigned int i = 0;
+#ifdef _WIN32
+	if(*header == '/' || *header == '\\' || header[1] == ':') directory_len = 0;
+#else
+	if(*header == '/') directory_len = 0;
+#endif
+	while(1) {
+		if(directory_len + 1 + header_len <= PATH_MAX) {
+			size_t len = directory_len;
+			memcpy(buffer, directory, len);
+			if(len && buffer[len - 1] != '/' && buffer[len - 1] != '\\') buffer[len++] = '/';
+			strcpy(buffer + len, header);
+			if(file_exists(buffer)) break;
+		}
+		while(++i < cc_argc && strncmp(cc_argv[i], "-I", 2));
+		if(i >= cc_argc) return NULL;
+		directory = cc_argv[i] + 2;
+		directory_len = strlen(directory);
+	}
+#ifdef _WIN32
+	char *path = _fullpath(NULL, buffer, 0);
+#else
+	char *path = realpath(buffer, NULL);
+#endif
+	if(!path && !(path = strdup(buffer))) fatal(ENOMEM);
+	return path;
+}
+
+static int is_c_source(const struct input_file *input) {
+	if(input->language) return strcmp(input->language, "-xc") == 0;
+	size_t len = strlen(input->name);
+	int n = get_last_dot(input->name, len);
+	return n >= 0 && strcasecmp(input->name + n, ".c") == 0;
+}
+
+static int create_precompiled_header(const char *program, const char *header, const char *pch) {
+	char *path = find_header(header, first_input_file);
+	if(!path) {
+		fprintf(stderr, "%s: error: cannot open include file: '%s'\n", program, header);
+		return 2;
+	}
+	FILE *f = fopen(pch, "w");
+	if(!f) {
+		fprintf(stderr, "%s: error: cannot create %s, %s\n", program, pch, strerror(errno));
+		free(path);
+		return 2;
+	}
+	fprintf(f, "#include \"%s\"\n", path);
+	if(fclose(f) == EOF) {
+		fprintf(stderr, "%s: error: cannot write %s, %s\n", program, pch, strerror(errno));
+		free(path);
+		return 2;
+	}
+
+	size_t pch_len = strlen(pch);
+	char gch[pch_len + 4 + 1];
+	memcpy(gch, pch, pch_len);
+	strcpy(gch + pch_len, ".gch");
+	char *argv[cc_argc + 6];
+	unsigned int argc = get_options(argv);
+	argv[argc++] = is_c_source(input_files) ? "-xc-header" : "-xc++-header";
+	argv[argc++] = path;
+	argv[argc++] = "-o";
+	argv[argc++] = gch;
+	argv[argc] = NULL;
+	print_command_line(argv);
+	int r = start_cc(argv);
+	free(path);
+	return r;
+}
+
+// Whether the line from line to end is an #include of header, with the names compared as cl does
+static int is_include_of(const char *line, const char *end, const char *header) {
+	while(line < end && (*line == ' ' || *line == '	')) line++;
+	if(line == end || *line++ != '#') return 0;
+	while(line < end && (*line == ' ' || *line == '	')) line++;
+	if(end - line < 7 || strncmp(line, "include", 7)) return 0;
+	line += 7;
+	while(line < end && (*line == ' ' || *line == '	')) line++;
+	if(line == end || (*line != '"' && *line != '<')) return 0;
+	char close = *line++ == '"' ? '"' : '>';
+	while(*header) {
+		if(line == end) return 0;
+		int c1 = (unsigned char)*line++, c2 = (unsigned char)*header++;
+		if(c1 == '\\') c1 = '/';
+		if(c2 == '\\') c2 = '/';
+		if(tolower(c1) != tolower(c2)) return 0;
+	}
+	return line < end && *line == close;
+}
+
+static char *read_file(const char *file, size_t *size) {
+	FILE *f = fopen(file, "rb");
+	if(!f) return NULL;
+	size_t max_size = 65536, len = 0, s;
+	char *data = malloc(max_size);
+	if(!data) fatal(ENOMEM);
+	while((s = fread(data + len, 1, max_size - len, f)) > 0) {
+		len += s;
+		if(len == max_size) {
+			max_size *= 2;
+			data = realloc(data, max_size);
+			if(!data) fatal(ENOMEM);
+		}
+	}
+	int e = ferror(f) ? errno : 0;
+	fclose(f);
+	if(e) {
+		free(data);
+		errno = e;
+		return NULL;
+	}
+	*size = len;
+	return data;
+}
+
+// Replaces the source in cc_argv with a copy that starts after its #include of header
+static int skip_precompiled_part(const char *program, struct input_file *input, const char *header) {
+	size_t size;
+	char *data = read_file(input->name, &size);
+	if(!data) {
+		fprintf(stderr, "%s: error: cannot open source file: '%s', %s\n", program, input->name, strerror(errno));
+		return 2;
+	}
+	const char *p = data, *end = data + size, *eol;
+	unsigned int line = 1;
+	while(1) {
+		if(p >= end) {
+			fprintf(stderr, "%s: error: unexpected end of file while looking for precompiled header; '%s' has no #include \"%s\"\n",
+				program, input->name, header);
+			free(data);
+			return 2;
+		}
+		if(!(eol = memchr(p, '\n', end - p))) eol = end;
+		if(is_include_of(p, eol, header)) break;
+		p = eol + 1;
+		line++;
+	}
+	p = eol < end ? eol + 1 : end;
+
+	char *directory = make_temporary_directory();
+	if(!directory) {
+		fprintf(stderr, "%s: error: cannot create a temporary directory, %s\n", program, strerror(errno));
+		free(data);
+		return 2;
+	}
+	size_t len = strlen(input->name);
+	size_t n = get_file_name(input->name, len);
+	size_t directory_len = strlen(directory);
+	char *copy = malloc(directory_len + 1 + len - n + 1);
+	if(!copy) fatal(ENOMEM);
+	memcpy(copy, directory, directory_len);
+	copy[directory_len] = '/';
+	strcpy(copy + directory_len + 1, input->name + n);
+	FILE *f = fopen(copy, "wb");
+	if(!f) {
+		fprintf(stderr, "%s: error: cannot create %s, %s\n", program, copy, strerror(errno));
+		free(copy);
+		free(data);
+		return 2;
+	}
+	add_temporary_file(copy);
+	fprintf(f, "#line %u \"", line + 1);
+	const char *s;
+	for(s = input->name; *s; s++) {
+		if(*s == '\\' || *s == '"') fputc('\\', f);
+		fputc(*s, f);
+	}
+	fputs("\"\n", f);
+	fwrite(p, 1, end - p, f);
+	free(data);
+	if(fclose(f) == EOF) {
+		fprintf(stderr, "%s: error: cannot write %s, %s\n", program, copy, strerror(errno));
+		return 2;
+	}
+
+	free(cc_argv[input->index]);
+	if(!(cc_argv[input->index] = strdup(copy))) fatal(ENOMEM);
+	if(n) {
+		char *quote_directory = malloc(n + 1);
+		if(!quote_directory) fatal(ENOMEM);
+		memcpy(quote_directory, input->name, n);
+		quote_directory[n] = 0;
+		input->quote_directory = quote_directory;
+	} else input->quote_directory = ".";
+	return 0;
+}
+
+static int use_precompiled_header(const char *program) {
+	const char *header = pch_create ? pch_create : pch_use;
+	unsigned int i;
+	if(!*header) {
+		fprintf(stderr, "%s: warning: precompiled headers ending at #pragma hdrstop are not supported; compiling without one\n", program);
+		return 0;
+	}
+	char *pch = pch_file && !is_directory_name(pch_file) ? strdup(pch_file) :
+		get_output_name(pch_file, pch_create ? first_input_file : header, ".pch");
+	if(!pch) fatal(ENOMEM);
+	int r = pch_create ? create_precompiled_header(program, header, pch) : 0;
+	if(!r) {
+		add_arg("-include");
+		add_arg(pch);
+	}
+	free(pch);
+	for(i = 0; i < input_files_count && !r; i++) r = skip_precompiled_part(program, input_files + i, header);
+	return r;
+}
+
+/*	The linker cc runs is the default ld, or the one in CL2CC_LD, such as
+	lld or gold, which is passed on as -fuse-ld=; only those two can fold
+	identical functions or order them for /OPT:ICF and /ORDER.
+*/
+static const char *get_linker() {
+	const char *ld = getenv("CL2CC_LD");
+	return ld && *ld ? ld : NULL;
+}
+
+static int is_linker(const char *name) {
+	const char *ld = get_linker();
+	return ld && strcmp(ld, name) == 0;
+}
+
+// Puts every function and object in a section of its own, for the linker to drop, fold or order
+static void add_sections_args() {
+	static int added;
+	if(added) return;
+	add_arg("-ffunction-sections");
+	add_arg("-fdata-sections");
+	added = 1;
+}
+
+// The comma separated arguments of /OPT
+static void add_opt_args(const char *program, const char *a) {
+	while(*a) {
+		size_t len = strcspn(a, ",");
+		if(len == 3 && strncasecmp(a, "ref", 3) == 0) {
+			add_sections_args();
+			add_arg("-Wl,--gc-sections");
+		} else if(len >= 3 && strncasecmp(a, "icf", 3) == 0 && (len == 3 || a[3] == '=')) {
+			if(is_linker("lld") || is_linker("gold")) {
+				add_sections_args();
+				add_arg("-Wl,--icf=all");
+			} else fprintf(stderr, "%s: warning: /OPT:ICF needs CL2CC_LD=lld or gold; ignored\n", program);
+		} else if(!((len == 5 && strncasecmp(a, "noref", 5) == 0) || (len == 5 && strncasecmp(a, "noicf", 5) == 0) ||
+		(len == 3 && strncasecmp(a, "lbr", 3) == 0) || (len == 5 && strncasecmp(a, "nolbr", 5) == 0))) {
+			fprintf(stderr, "%s: warning: ignoring unknown /OPT argument '%.*s'\n", program, (int)len, a);
+		}
+		a += len;
+		if(*a) a++;
+	}
+}
+
+// /STACK and /HEAP, reserve[,commit]
+static void add_stack_args(const char *program, const char *option, const char *a) {
+#ifdef _WIN32
+	char buffer[2 + strlen(option) + 1];
+	strcpy(buffer, "--");
+	strcpy(buffer + 2, option);
+	add_arg("-Xlinker");
+	add_arg(buffer);
+	add_arg("-Xlinker");
+	add_arg(a);
+#else
+	if(strcmp(option, "heap") == 0) {
+		fprintf(stderr, "%s: warning: /HEAP has no equivalent for ELF; ignored\n", program);
+		return;
+	}
+	// The commit size has no meaning here
+	size_t len = strcspn(a, ",");
+	char buffer[18 + len + 1];
+	sprintf(buffer, "-Wl,-z,stack-size=%.*s", (int)len, a);
+	add_arg(buffer);
+#endif
+}
+
+/*	/ORDER:@file lists a function per line; lld takes the same list, gold
+	wants the names of their sections.
+*/
+static int add_order_args(const char *program, const char *file) {
+	if(is_linker("lld")) {
+		char buffer[27 + strlen(file) + 1];
+		strcpy(buffer, "-Wl,--symbol-ordering-file=");
+		strcat(buffer, file);
+		add_sections_args();
+		add_arg(buffer);
+		return 0;
+	}
+	if(!is_linker("gold")) {
+		fprintf(stderr, "%s: warning: /ORDER needs CL2CC_LD=lld or gold; ignored\n", program);
+		return 0;
+	}
+	size_t size;
+	char *data = read_file(file, &size);
+	if(!data) {
+		fprintf(stderr, "%s: error: cannot open file '%s', %s\n", program, file, strerror(errno));
+		return 2;
+	}
+	char *directory = make_temporary_directory();
+	if(!directory) {
+		fprintf(stderr, "%s: error: cannot create a temporary directory, %s\n", program, strerror(errno));
+		free(data);
+		return 2;
+	}
+	size_t directory_len = strlen(directory);
+	char *sections = malloc(directory_len + 10 + 1);
+	if(!sections) fatal(ENOMEM);
+	strcpy(sections, directory);
+	strcpy(sections + directory_len, "/order.txt");
+	FILE *f = fopen(sections, "w");
+	if(!f) {
+		fprintf(stderr, "%s: error: cannot create %s, %s\n", program, sections, strerror(errno));
+		free(sections);
+		free(data);
+		return 2;
+	}
+	add_temporary_file(sections);
+	const char *p = data, *end = data + size;
+	while(p < end) {
+		const char *eol = memchr(p, '\n', end - p);
+		if(!eol) eol = end;
+		const char *name = p, *name_end = eol;
+		while(name < name_end && (*name == ' ' || *name == '	')) name++;
+		while(name_end > name && (name_end[-1] == '\r' || name_end[-1] == ' ' || name_end[-1] == '	')) name_end--;
+		if(name < name_end) fprintf(f, ".text.%.*s\n", (int)(name_end - name), name);
+		p = eol + 1;
+	}
+	free(data);
+	if(fclose(f) == EOF) {
+		fprintf(stderr, "%s: error: cannot write %s, %s\n", program, sections, strerror(errno));
+		return 2;
+	}
+	char buffer[28 + strlen(sections) + 1];
+	strcpy(buffer, "-Wl,--section-ordering-file=");
+	strcat(buffer, sections);
+	add_sections_args();
+	add_arg(buffer);
+	return 0;
+}
+
 static void print_help() {
 	puts("libdll.so cl2cc " VERSION);
 	puts("Copyright 2015 libdll.so");
@@ -224,87 +1197,13 @@ int disable_warning_by_number(unsigned int number) {
 	return 0;
 }
 
-static int get_line_from_file(char *line, const char *file, size_t count) {
-	//fprintf(stderr, "function: get_line_from_file(%p, %p<%s>, %u)\n", line, file, file, (unsigned int)count);
-	fflush(stdout);
-	char buffer[count];
-	void *f = CreateFileA(file, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-	if(!f) return -1;
-	unsigned long int read_size;
-	if(!ReadFile(f, buffer, count, &read_size, NULL)) return -1;
-	//buffer[read_size / sizeof(char)] = 0;
-	//wcstombs(line, buffer + 1, read_size);
-	memcpy(line, buffer, read_size);
-	int r = read_size;
-	char *p = line;
-	printf("read_size = %lu\n", read_size);
-	fflush(stdout);
-	while(p - line < read_size) {
-		if(*p++ == '\r' && *p == '\n') {
-			char *np = p;
-			p[-1] = ' ';
-			//while((*np = *++np));
-			while((np[0] = np[1])) np++;
-			r--;
-		}
-	}
-	return r;
-}
-
-//static int get_arg_len(const char *s) {
-//}
-
-int expend_command_line_from_file(/*const char *file*/) {
-#define BUFFER_SIZE (PATH_MAX * 4)
-
-	STARTUPINFOA si = { .cb = sizeof(STARTUPINFOA) };
-	PROCESS_INFORMATION pi;
-	unsigned long int r;
-	char program[PATH_MAX + 1];
-	if(!GetModuleFileNameA(NULL, program, sizeof program)) {
-		fprintf(stderr, "GetModuleFileNameA failed, error %lu\n", GetLastError());
-		return 1;
-	}
-	char *old_command_line = GetCommandLineA();
-	char new_command_line[BUFFER_SIZE], *p = new_command_line;
-	//if(!get_line_from_file(new_))
-	do {
-		int free_len = sizeof new_command_line - (p - new_command_line) - 1;
-		if(free_len < 1) {
-			fprintf(stderr, "command line too long");
-			return -1;
-		}
-		if(*old_command_line == '@') {
-			//int old_len = get_arg_len(old_command_line)
-			int old_len = 0;
-			char file[PATH_MAX];
-			old_command_line++;
-			while(*old_command_line && *old_command_line != ' ' && *old_command_line != '	' && *old_command_line != '\n') {
-				file[old_len++] = *old_command_line++;
-			}
-			file[old_len] = 0;
-			int new_len = get_line_from_file(p, file, free_len);
-			if(new_len < 0) {
-				fprintf(stderr, "failed to read command line file %s, %lu\n", file, GetLastError());
-				return 1;
-			}
-			p += new_len;
-		} else *p++ = *old_command_line++;
-	} while(*old_command_line);
-	*p = 0;
-
-	//fprintf(stdout, "[stdout] old_command_line: \"%s\", program: \"%s\", new_command_line: \"%s\"\n", old_command_line, program, new_command_line);
-	//fprintf(stderr, "[stderr] old_command_line: \"%s\", program: \"%s\", new_command_line: \"%s\"\n", old_command_line, program, new_command_line);
-	if(!CreateProcessA(program, new_command_line, NULL, NULL, 0, 0, NULL, NULL, &si, &pi)) {
-		fprintf(stderr, "failed to restart %s, error %lu\n", program, GetLastError());
-		return 1;
-	}
-	WaitForSingleObject(pi.hProcess, INFINITE);
-	GetExitCodeProcess(pi.hProcess, &r);
-	CloseHandle(pi.hProcess);
-	CloseHandle(pi.hThread);
-	return r;
+#ifndef _WIN32
+// On POSIX an absolute path starts with '/' too; one that exists is taken as a file
+static int is_absolute_file(const char *arg) {
+	struct stat st;
+	return *arg == '/' && stat(arg, &st) == 0;
 }
+#endif
 
 int main(int argc, char **argv) {
 #define UNRECOGNIZED_OPTION(O) \
@@ -324,6 +1223,9 @@ int main(int argc, char **argv) {
 	}
 
 
+	stats_begin();
+	record_begin(RECORD_CL2CC, argc, argv);
+	if(!(argv = respfile_expand(&argc, argv))) return 2;
 	const char *include_path = getenv("INCLUDE");
 	if(include_path) add_paths(include_path, add_include_path);
 	const char *library_path = getenv("LIB");
@@ -332,19 +1234,31 @@ int main(int argc, char **argv) {
 	int preprocess_to_file = 0;
 	int no_link = 0;
 	int linker_option = 0;
+	int parallel = 0;
+	int r;
 	//int output_file_seted = 0;
 	const char *output_file = NULL;
 	char **v = argv;
 	init_command_line();
 
 	while(*++v) {
-		if(**v == '@') {
-			return expend_command_line_from_file(*v + 1);
-		} else if(**v == '-' || **v == '/') {
+		if(**v == '-' || (**v == '/'
+#ifndef _WIN32
+		&& !is_absolute_file(*v)
+#endif
+		)) {
 			const char *arg = *v + 1;
 			if(linker_option) {
-				if(strcasecmp(arg, "debug") == 0) {
-					add_arg("-g");
+				if(strncasecmp(arg, "debug", 5) == 0) {
+					const char *a = arg + 5;
+					if(!*a || strcasecmp(a, ":full") == 0) {
+						add_arg("-g");
+					} else if(strcasecmp(a, ":fastlink") == 0) {
+						// The debug information stays in .dwo files, indexed by the linker
+						add_arg("-g");
+						add_arg("-gsplit-dwarf");
+						if(is_linker("lld") || is_linker("gold")) add_arg("-Wl,--gdb-index");
+					} else if(strcasecmp(a, ":none")) while(1) UNRECOGNIZED_OPTION(*v);
 				} else if(strcasecmp(arg, "dll") == 0) {
 					add_arg("--shared");
 				} else if(strncasecmp(arg, "entry", 5) == 0) {
@@ -378,8 +1292,41 @@ no_arg:
 					} else if(arg[17]) while(1) {
 						UNRECOGNIZED_OPTION(*v);
 					} else add_arg("-Wl,--large-address-aware");
+				} else if(strncasecmp(arg, "genprofile", 10) == 0 || strncasecmp(arg, "fastgenprofile", 14) == 0) {
+					const char *a = arg + (tolower(*arg) == 'f' ? 14 : 10);
+					if(*a && *a != ':') UNRECOGNIZED_OPTION(*v);
+					profile = PROFILE_GENERATE;
+					if(*a) set_profile_database(a + 1);
+				} else if(strncasecmp(arg, "ltcg", 4) == 0) {
+					const char *a = arg + 4;
+					if(!*a || strcasecmp(a, ":incremental") == 0 || strcasecmp(a, ":status") == 0 || strcasecmp(a, ":nostatus") == 0) {
+						add_lto_arg();
+					} else if(strcasecmp(a, ":off") == 0) {
+						add_arg("-fno-lto");
+					} else if(strcasecmp(a, ":pginstrument") == 0) {
+						add_lto_arg();
+						profile = PROFILE_GENERATE;
+					} else if(strcasecmp(a, ":pgoptimize") == 0 || strcasecmp(a, ":pgupdate") == 0) {
+						add_lto_arg();
+						profile = PROFILE_USE;
+					} else while(1) UNRECOGNIZED_OPTION(*v);
+				} else if(strncasecmp(arg, "heap:", 5) == 0) {
+					if(!arg[5]) goto no_arg;
+					add_stack_args(argv[0], "heap", arg + 5);
+				} else if(strncasecmp(arg, "incremental", 11) == 0) {
+					if(!arg[11]) fprintf(stderr, "%s: warning: incremental linking is not supported\n", argv[0]);
+					else if(strcasecmp(arg + 11, ":no")) while(1) UNRECOGNIZED_OPTION(*v);
 				} else if(strcasecmp(arg, "nologo") == 0) {
 					// Do nothing
+				} else if(strncasecmp(arg, "opt:", 4) == 0) {
+					if(!arg[4]) goto no_arg;
+					add_opt_args(argv[0], arg + 4);
+				} else if(strncasecmp(arg, "order:", 6) == 0) {
+					if(arg[6] != '@' || !arg[7]) goto no_arg;
+					if((r = add_order_args(argv[0], arg + 7))) {
+						remove_temporary_files();
+						return r;
+					}
 				} else if(strncasecmp(arg, "out", 3) == 0) {
 					__label__ no_arg;
 					if(arg[3] == ':') {
@@ -396,6 +1343,9 @@ no_arg:
 						}
 						while(1) UNRECOGNIZED_OPTION(*v);
 					}
+				} else if(strncasecmp(arg, "stack:", 6) == 0) {
+					if(!arg[6]) goto no_arg;
+					add_stack_args(argv[0], "stack", arg + 6);
 				} else if(strncasecmp(arg, "subsystem", 9) == 0) {
 					__label__ no_arg;
 					// -Wl,--subsystem,
@@ -416,11 +1366,24 @@ no_arg:
 						}
 						while(1) UNRECOGNIZED_OPTION(*v);
 					}
+				} else if(strncasecmp(arg, "pgd:", 4) == 0) {
+					if(!arg[4]) goto no_arg;
+					profile_database = arg + 4;
+				} else if(strncasecmp(arg, "useprofile", 10) == 0) {
+					const char *a = arg + 10;
+					if(*a && *a != ':') UNRECOGNIZED_OPTION(*v);
+					profile = PROFILE_USE;
+					if(*a) set_profile_database(a + 1);
 				} else if(strcasecmp(arg, "wx") == 0) {
 					add_arg("-Werror");
 				} else while(1) UNRECOGNIZED_OPTION(*v);
 			} else switch(*arg) {
 				case 'c':
+					if(strncmp(arg, "cgthreads", 9) == 0) {
+						// The code generator of cc is single threaded
+						if(arg[9] && (arg[9] < '1' || arg[9] > '8' || arg[10])) UNRECOGNIZED_OPTION(*v);
+						break;
+					}
 					if(arg[1]) UNRECOGNIZED_OPTION(*v);
 					add_arg("-c");
 					no_link = 1;
@@ -467,11 +1430,17 @@ no_arg:
 						case 'A':
 						case 'd':
 						case 'm':
-						case 'p':
 						case 'r':
 						case 'R':
 							fprintf(stderr, "%s: warning: '%s' is not supported\n", argv[0], *v);
 							break;
+						case 'p':
+							if(!arg[2]) {
+								fprintf(stderr, "%s: error: '%s' requires an argument\n", argv[0], *v);
+								return 2;
+							}
+							pch_file = arg + 2;
+							break;
 						case 'I':
 							if(!arg[2]) {
 								fprintf(stderr, "%s: error: '%s' requires an argument\n", argv[0], *v);
@@ -490,18 +1459,27 @@ no_arg:
 							if(arg[2]) UNRECOGNIZED_OPTION(*v);
 							add_arg("-fno-writable-strings");
 							break;
+						case 'L':
+							if(arg[2]) {
+								if(arg[2] == '-') add_arg("-fno-lto");
+								else UNRECOGNIZED_OPTION(*v);
+							} else add_arg("-flto=auto");
+							break;
 						case 'X':
 							if(arg[2]) {
 								if(arg[2] == '-') add_arg("-fno-exceptions");
 								else UNRECOGNIZED_OPTION(*v);
 							} else add_arg("-fexceptions");
+							break;
 						case 'e':
 						case 'Z':
 							if(arg[2]) UNRECOGNIZED_OPTION(*v);
 							add_arg("-fstack-check");
+							break;
 						default:
 							UNRECOGNIZED_OPTION(*v);
 					}
+					break;
 				case 'J':
 					if(arg[1]) UNRECOGNIZED_OPTION(*v);
 					add_arg("-funsigned-char");
@@ -532,6 +1510,10 @@ no_arg:
 							fprintf(stderr, "%s: warning: linking with %s is not supported\n",
 								argv[0], arg[2] ? "libcmtd" : "libcmt");
 							break;
+						case 'P':
+							if(arg[2] && atoi(arg + 2) <= 0) UNRECOGNIZED_OPTION(*v);
+							mp_jobs = arg[2] ? atoi(arg + 2) : get_processor_count();
+							break;
 						default:
 							UNRECOGNIZED_OPTION(*v);
 					}
@@ -604,14 +1586,10 @@ no_arg:
 							fprintf(stderr, "%s: error: '%s' requires an argument\n", argv[0], *v);
 							return 2;
 						case 'c':
-							add_arg("-xc");
-							add_input_file(arg + 2);
-							add_arg("-xnone");
+							add_typed_input_file(arg + 2, "-xc");
 							break;
 						case 'p':
-							add_arg("-xc++");
-							add_input_file(arg + 2);
-							add_arg("-xnone");
+							add_typed_input_file(arg + 2, "-xc++");
 							break;
 						default:
 							UNRECOGNIZED_OPTION(*v);
@@ -708,6 +1686,27 @@ no_arg:
 					if(arg[1]) UNRECOGNIZED_OPTION(*v);
 					add_arg("-nostdinc");
 					break;
+				case 'Y':
+					switch(arg[1]) {
+						case 'c':
+							pch_create = arg + 2;
+							break;
+						case 'u':
+							pch_use = arg + 2;
+							break;
+						case '-':
+							if(arg[2]) UNRECOGNIZED_OPTION(*v);
+							pch_disabled = 1;
+							break;
+						case 'd':
+						case 'l':
+							// Debug information for the precompiled header
+							if(arg[2]) UNRECOGNIZED_OPTION(*v);
+							break;
+						default:
+							UNRECOGNIZED_OPTION(*v);
+					}
+					break;
 				case 'Z':
 					if(!arg[1]) {
 						fprintf(stderr, "%s: error: '%s' requires an argument\n", argv[0], *v);
@@ -765,7 +1764,8 @@ no_arg:
 							return 2;
 						}
 					} else if(strcmp(arg, "showIncludes") == 0) {
-						add_arg("-M");
+						add_arg("-H");
+						show_includes = 1;
 					} else if(strcmp(arg, "nologo") == 0) {
 						// Do nothing
 					} else {
@@ -777,16 +1777,34 @@ no_arg:
 			(linker_option ? (strcmp(*v + strlen(*v) - 4, ".lib") == 0 ? add_library : add_input_file) : add_input_file)(*v);
 		}
 	}
+	if(profile) add_profile_arg();
+	if(!no_link && get_linker()) {
+		const char *ld = get_linker();
+		char buffer[10 + strlen(ld) + 1];
+		strcpy(buffer, "-fuse-ld=");
+		strcpy(buffer + 9, ld);
+		add_arg(buffer);
+	}
 	if(linker_option != 1) {
 		if(!first_input_file) {
 			fprintf(stderr, "%s: error: missing source filename\n", argv[0]);
 			return 2;
 		}
-		if(!output_file || preprocess_to_file) {
+		if((pch_create || pch_use) && !pch_disabled && (r = use_precompiled_header(argv[0]))) {
+			remove_temporary_files();
+			return r;
+		}
+		if(no_link && input_files_count > 1 && !preprocess_to_file) {
+			if(output_file && !is_directory_name(output_file)) {
+				fprintf(stderr, "%s: error: cannot name one object '%s' for several sources\n", argv[0], output_file);
+				return 2;
+			}
+			parallel = 1;
+		} else if(!output_file || preprocess_to_file) {
 			size_t len = strlen(first_input_file);
 			int n = get_last_dot(first_input_file, len);
 			if(n >= 0) len = n;
-			char *p = malloc(len + preprocess_to_file ? 3 : 5);
+			char *p = malloc(len + (preprocess_to_file ? 3 : 5));
 			if(!p) {
 				perror(argv[0]);
 				return 1;
@@ -795,31 +1813,29 @@ no_arg:
 			strcpy(p + len, preprocess_to_file ? ".i" : (no_link ? ".obj" : ".exe"));
 			output_file = p;
 			//set_output_file(p);
-		} else {
-			size_t orig_len = strlen(output_file);
-			if(output_file[orig_len - 1] == '/') {
-				size_t add_len = strlen(first_input_file);
-				int n1 = get_file_name(first_input_file, add_len);
-				int n2 = get_last_dot(first_input_file, add_len);
-				if(n2 >= 0) add_len = n2;
-				if(n1 > 0) {
-					assert(n1 < add_len);
-					first_input_file += n1;
-					add_len -= n1;
-				}
-				char *p = malloc(orig_len + add_len + 5);
-				if(!p) {
-					perror(argv[0]);
-					return 1;
-				}
-				memcpy(p, output_file, orig_len);
-				memcpy(p + orig_len, first_input_file, add_len);
-				strcpy(p + orig_len + add_len, no_link ? ".obj" : ".exe");
-				output_file = p;
+		} else if(is_directory_name(output_file)) {
+			output_file = get_output_name(output_file, first_input_file, no_link ? ".obj" : ".exe");
+		}
+		if(!parallel) {
+			unsigned int i;
+			for(i = 0; i < input_files_count; i++) if(input_files[i].quote_directory) {
+				add_arg("-iquote");
+				add_arg(input_files[i].quote_directory);
 			}
+			set_output_file(output_file);
 		}
-		set_output_file(output_file);
 	}
-	puts(cc_command_line);
-	return start_cc();
+	record_command(cc_argc, cc_argv);
+	if(parallel) r = start_jobs(output_file);
+	else {
+		print_command_line(cc_argv);
+		r = start_cc(cc_argv);
+	}
+	stats_end(STATS_CL2CC, r, parallel ? NULL : output_file);
+	record_end(r);
+	remove_temporary_files();
+#ifndef _WIN32
+	children_resend_signal();
+#endif
+	return r;
 }
@@ -0,0 +1,259 @@
+/*	clworker
+	Copyright 2015 libdll.so
+
+	This program is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation; either version 2 of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+*/
+
+/*	Compiles preprocessed sources sent by cc2cl, see dist.h.  Every
+	connection is served by a process of its own, which receives the source
+	into a new directory of its own in the work directory while cl is not
+	yet running, and streams the object back as it reads it.
+*/
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <limits.h>
+#include "dist.h"
+
+#define MAX_LISTENERS 16
+
+static const char *program_name;
+static const char *compiler = "cl";
+static unsigned int running;
+
+static void __attribute__((__noreturn__)) usage() {
+	fprintf(stderr, "Usage: %s [-j <jobs>] [-c <compiler>] [-d <directory>] <address> [<address> ...]\n", program_name);
+	fputs("	-j	Compile up to <jobs> sources at once, default the number of processors\n"
+		"	-c	Run <compiler> instead of CL_LOCATION or cl\n"
+		"	-d	Keep the temporary files in <directory> instead of TMPDIR or /tmp\n"
+		"<address> is unix:<path>, tcp:<host>:<port> or tcp::<port> for every interface\n", stderr);
+	exit(-1);
+}
+
+static void sigchld_handler(int sig) {
+}
+
+/*	Options that only change code generation or diagnostics; anything else,
+	such as /B1, /Bx, /F*, /doc or /analyze:plugin, could make cl read, write
+	or run a file the client names on the worker.
+*/
+static int is_allowed_option(const char *arg) {
+	static const char *options[] = {
+		"Brepro", "J", "LD", "LDd", "MD", "MDd", "MT", "MTd", "Qpar", "Z7", "Za", "Ze", "Zl", "Zs",
+		"bigobj", "nologo", "openmp", "permissive-", "sdl", "sdl-", "showIncludes", "utf-8"
+	};
+	static const char *prefixes[] = {
+		"D", "EH", "G", "O", "Qspectre", "RTC", "U", "W", "Zc:", "Zp", "arch:", "d1trimfile:",
+		"execution-charset:", "favor:", "fp:", "guard:", "openmp:", "pathmap:", "source-charset:",
+		"std:", "volatile:", "w"
+	};
+	unsigned int i;
+	if((*arg != '-' && *arg != '/') || !*++arg) return 0;
+	for(i = 0; i < sizeof options / sizeof *options; i++) {
+		if(strcmp(arg, options[i]) == 0) return 1;
+	}
+	for(i = 0; i < sizeof prefixes / sizeof *prefixes; i++) {
+		if(strncmp(arg, prefixes[i], strlen(prefixes[i])) == 0) return 1;
+	}
+	return 0;
+}
+
+// Only ever a new file, in the private directory of the request
+static int create_file(const char *name) {
+	return open(name, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+}
+
+static char *read_file(const char *name, size_t max) {
+	int fd = open(name, O_RDONLY);
+	if(fd == -1) return NULL;
+	struct stat st;
+	char *r = fstat(fd, &st) < 0 || st.st_size > max ? NULL : malloc(st.st_size + 1);
+	if(r) {
+		ssize_t s = read(fd, r, st.st_size);
+		r[s < 0 ? 0 : s] = 0;
+	}
+	close(fd);
+	return r;
+}
+
+static void serve(int fd, const char *directory) {
+	char source[32], object[32], out[32], err[32];
+	sprintf(source, "%s/source.i", directory);
+	sprintf(object, "%s/source.obj", directory);
+	sprintf(out, "%s/cl.out", directory);
+	sprintf(err, "%s/cl.err", directory);
+
+	uint32_t argc, language, i;
+	if(dist_recv_u32(fd, &argc) < 0 || argc > DIST_MAX_ARGC) return;
+	char *argv[1 + argc + 3 + 1];
+	argv[0] = (char *)compiler;
+	for(i = 1; i <= argc; i++) {
+		if(!(argv[i] = dist_recv_string(fd))) return;
+		if(!is_allowed_option(argv[i])) {
+			fprintf(stderr, "%s: rejecting option '%s'\n", program_name, argv[i]);
+			return;
+		}
+	}
+	if(dist_recv_u32(fd, &language) < 0 || (language != 'c' && language != 'p')) return;
+	char source_option[3 + sizeof source], object_option[3 + sizeof object];
+	sprintf(source_option, "-T%c%s", (char)language, source);
+	sprintf(object_option, "-Fo%s", object);
+	argv[++argc] = "-c";
+	argv[++argc] = source_option;
+	argv[++argc] = object_option;
+	argv[++argc] = NULL;
+
+	int source_fd = create_file(source);
+	if(source_fd == -1) {
+		perror(source);
+		return;
+	}
+	long long int size = dist_recv_to_fd(fd, source_fd);
+	uint32_t go;
+	close(source_fd);
+	if(size < 0 || dist_recv_u32(fd, &go) < 0 || go != DIST_COMPILE) {
+		unlink(source);
+		return;
+	}
+
+	int r;
+	pid_t child = fork();
+	if(child == -1) {
+		perror("fork");
+		r = 127;
+	} else if(child == 0) {
+		int out_fd = create_file(out), err_fd = create_file(err);
+		if(out_fd == -1 || err_fd == -1) _exit(127);
+		dup2(out_fd, 1);
+		dup2(err_fd, 2);
+		execvp(compiler, argv);
+		perror(compiler);
+		_exit(127);
+	} else {
+		int status;
+		while(waitpid(child, &status, 0) < 0) {
+			if(errno != EINTR) {
+				status = 127 << 8;
+				break;
+			}
+		}
+		r = WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status) + 126;
+	}
+	unlink(source);
+
+	char *out_data = read_file(out, 16 * 1024 * 1024), *err_data = read_file(err, 16 * 1024 * 1024);
+	unlink(out);
+	unlink(err);
+	int object_fd = r ? -1 : open(object, O_RDONLY);
+	unlink(object);
+	if(!r && object_fd == -1) r = 1;
+	if(dist_send_u32(fd, r) == 0 &&
+	dist_send_data(fd, out_data ? out_data : "", out_data ? strlen(out_data) : 0) == 0 &&
+	dist_send_data(fd, err_data ? err_data : "", err_data ? strlen(err_data) : 0) == 0) {
+		if(object_fd == -1) dist_send_u64(fd, 0);
+		else dist_send_stream(fd, object_fd);
+	}
+	if(object_fd != -1) close(object_fd);
+}
+
+int main(int argc, char **argv) {
+	unsigned int jobs = 0;
+	const char *directory = getenv("TMPDIR");
+	const char *addresses[MAX_LISTENERS];
+	int listeners = 0;
+	char **v = argv;
+	program_name = argv[0];
+	if(getenv("CL_LOCATION")) compiler = getenv("CL_LOCATION");
+	if(!directory) directory = "/tmp";
+	while(*++v) {
+		if(**v != '-') {
+			if(listeners == MAX_LISTENERS) usage();
+			addresses[listeners++] = *v;
+			continue;
+		}
+		const char *arg = *v + 1;
+		const char *value = arg[1] ? arg + 1 : v[1];
+		if(!strchr("jcd", *arg) || !value) usage();
+		if(!arg[1]) v++;
+		switch(*arg) {
+			case 'j':
+				if((int)(jobs = atoi(value)) < 1) usage();
+				break;
+			case 'c':
+				compiler = value;
+				break;
+			case 'd':
+				directory = value;
+				break;
+		}
+	}
+	if(!listeners) usage();
+	if(!jobs) {
+		long int n = sysconf(_SC_NPROCESSORS_ONLN);
+		jobs = n > 0 ? n : 1;
+	}
+	if(chdir(directory) < 0) {
+		perror(directory);
+		return 1;
+	}
+
+	struct pollfd fds[MAX_LISTENERS];
+	int i;
+	for(i = 0; i < listeners; i++) {
+		if((fds[i].fd = dist_listen(addresses[i])) == -1) {
+			fprintf(stderr, "%s: cannot listen on %s, %s\n", argv[0], addresses[i], strerror(errno));
+			return 1;
+		}
+		fds[i].events = POLLIN;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	// Without SA_RESTART, so a finished job interrupts poll
+	struct sigaction action = { .sa_handler = sigchld_handler };
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGCHLD, &action, NULL);
+
+	while(1) {
+		while(running && waitpid(-1, NULL, WNOHANG) > 0) running--;
+		if(poll(fds, listeners, -1) < 0) {
+			if(errno == EINTR) continue;
+			perror("poll");
+			return 1;
+		}
+		for(i = 0; i < listeners; i++) {
+			if(!(fds[i].revents & POLLIN)) continue;
+			int fd = accept(fds[i].fd, NULL, NULL);
+			if(fd == -1) continue;
+			if(running >= jobs) {
+				// The client will try another worker or compile locally
+				dist_send_u32(fd, DIST_MAGIC);
+				dist_send_u32(fd, DIST_BUSY);
+				close(fd);
+				continue;
+			}
+			pid_t pid = fork();
+			if(pid == -1) {
+				perror("fork");
+				close(fd);
+				continue;
+			}
+			if(pid == 0) {
+				for(i = 0; i < listeners; i++) close(fds[i].fd);
+				signal(SIGCHLD, SIG_DFL);
+				// Every request gets a directory of its own, which no other user can put links in
+				char directory[] = "clworker-XXXXXX";
+				if(!mkdtemp(directory)) {
+					perror("mkdtemp");
+					_exit(1);
+				}
+				if(dist_send_u32(fd, DIST_MAGIC) == 0 && dist_send_u32(fd, DIST_READY) == 0) serve(fd, directory);
+				rmdir(directory);
+				_exit(0);
+			}
+			running++;
+			close(fd);
+		}
+	}
+}
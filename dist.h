@@ -0,0 +1,279 @@
+/*	Distributed compilation protocol shared by cc2cl and clworker
+	Copyright 2015 libdll.so
+
+	This program is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation; either version 2 of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+*/
+
+/*
+	A worker address is 'unix:<path>', 'tcp:<host>:<port>' or just
+	'<host>:<port>'.  All integers are in network byte order.
+
+	On accepting, the worker sends
+		uint32_t magic, state		DIST_READY, or DIST_BUSY and closes
+	then the client sends
+		uint32_t argc			cl options, without the source and -Fo
+		argc times uint32_t length, bytes
+		uint32_t language		'c' or 'p', as in -Tc and -Tp
+		uint64_t size, bytes		the preprocessed source
+		uint32_t go			DIST_COMPILE, or DIST_CANCEL if
+						preprocessing failed midway
+	and the worker answers
+		int32_t status
+		uint64_t size, bytes		cl's standard output
+		uint64_t size, bytes		cl's standard error
+		uint64_t size, bytes		the object, empty if cl failed
+
+	Sizes may be DIST_UNKNOWN_SIZE, in which case the data follows in
+	chunks, each a uint32_t length and that many bytes, ending with an
+	empty chunk; that lets a sender stream data it doesn't have yet.
+
+	Workers only take options that change code generation or diagnostics,
+	but cl still preprocesses the source it is sent, so a client can
+	#include any file the worker can read; only run them on a trusted
+	network.
+*/
+
+#ifndef _DIST_H
+#define _DIST_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#define DIST_MAGIC 0x43434431		// "CCD1"
+#define DIST_READY 0
+#define DIST_BUSY 1
+#define DIST_COMPILE 0
+#define DIST_CANCEL 1
+
+#define DIST_MAX_ARGC 4096
+#define DIST_MAX_STRING 65536
+#define DIST_UNKNOWN_SIZE UINT64_MAX
+#define DIST_BUFFER_SIZE 65536
+
+static inline int dist_write_all(int fd, const void *data, size_t len) {
+	const char *p = data;
+	while(len) {
+		ssize_t s = write(fd, p, len);
+		if(s < 0) {
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		p += s;
+		len -= s;
+	}
+	return 0;
+}
+
+// Returns -1 on error or if the data ends early
+static inline int dist_read_all(int fd, void *data, size_t len) {
+	char *p = data;
+	while(len) {
+		ssize_t s = read(fd, p, len);
+		if(s < 0) {
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		if(!s) {
+			errno = ECONNRESET;
+			return -1;
+		}
+		p += s;
+		len -= s;
+	}
+	return 0;
+}
+
+static inline int dist_send_u32(int fd, uint32_t n) {
+	n = htonl(n);
+	return dist_write_all(fd, &n, sizeof n);
+}
+
+static inline int dist_recv_u32(int fd, uint32_t *n) {
+	if(dist_read_all(fd, n, sizeof *n) < 0) return -1;
+	*n = ntohl(*n);
+	return 0;
+}
+
+static inline int dist_send_u64(int fd, uint64_t n) {
+	uint32_t v[2] = { htonl(n >> 32), htonl(n & 0xffffffff) };
+	return dist_write_all(fd, v, sizeof v);
+}
+
+static inline int dist_recv_u64(int fd, uint64_t *n) {
+	uint32_t v[2];
+	if(dist_read_all(fd, v, sizeof v) < 0) return -1;
+	*n = (uint64_t)ntohl(v[0]) << 32 | ntohl(v[1]);
+	return 0;
+}
+
+static inline int dist_send_string(int fd, const char *s) {
+	size_t len = strlen(s);
+	if(dist_send_u32(fd, len) < 0) return -1;
+	return dist_write_all(fd, s, len);
+}
+
+// Returns a malloc'd string, NULL on error
+static inline char *dist_recv_string(int fd) {
+	uint32_t len;
+	if(dist_recv_u32(fd, &len) < 0 || len > DIST_MAX_STRING) return NULL;
+	char *s = malloc(len + 1);
+	if(!s) return NULL;
+	if(dist_read_all(fd, s, len) < 0) {
+		free(s);
+		return NULL;
+	}
+	s[len] = 0;
+	return s;
+}
+
+static inline int dist_send_data(int fd, const void *data, size_t len) {
+	if(dist_send_u64(fd, len) < 0) return -1;
+	return dist_write_all(fd, data, len);
+}
+
+// Sends everything from in_fd until its end, in chunks; in_fd may be a pipe
+static inline int dist_send_stream(int fd, int in_fd) {
+	char buffer[DIST_BUFFER_SIZE];
+	if(dist_send_u64(fd, DIST_UNKNOWN_SIZE) < 0) return -1;
+	while(1) {
+		ssize_t s = read(in_fd, buffer, sizeof buffer);
+		if(s < 0) {
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		if(dist_send_u32(fd, s) < 0 || dist_write_all(fd, buffer, s) < 0) return -1;
+		if(!s) return 0;
+	}
+}
+
+// Copies data of either form to out_fd; returns the number of bytes, -1 on error
+static inline long long int dist_recv_to_fd(int fd, int out_fd) {
+	char buffer[DIST_BUFFER_SIZE];
+	uint64_t size, total = 0;
+	int chunked;
+	if(dist_recv_u64(fd, &size) < 0) return -1;
+	chunked = size == DIST_UNKNOWN_SIZE;
+	while(1) {
+		if(chunked) {
+			uint32_t chunk;
+			if(dist_recv_u32(fd, &chunk) < 0) return -1;
+			if(!chunk) break;
+			size = chunk;
+		} else if(total == size) break;
+		uint64_t left = chunked ? size : size - total;
+		while(left) {
+			size_t len = left < sizeof buffer ? left : sizeof buffer;
+			if(dist_read_all(fd, buffer, len) < 0 || dist_write_all(out_fd, buffer, len) < 0) return -1;
+			left -= len;
+			total += len;
+		}
+	}
+	return total;
+}
+
+// Returns a malloc'd, NUL terminated buffer; the data may not be chunked
+static inline char *dist_recv_data(int fd, size_t max) {
+	uint64_t size;
+	if(dist_recv_u64(fd, &size) < 0 || size > max) return NULL;
+	char *r = malloc(size + 1);
+	if(!r) return NULL;
+	if(dist_read_all(fd, r, size) < 0) {
+		free(r);
+		return NULL;
+	}
+	r[size] = 0;
+	return r;
+}
+
+// Fills in a socket address for an address string; returns the socket family, -1 if invalid
+static inline int dist_parse_address(const char *address, struct sockaddr_storage *addr, socklen_t *len) {
+	memset(addr, 0, sizeof *addr);
+	if(strncmp(address, "unix:", 5) == 0) {
+		struct sockaddr_un *un = (struct sockaddr_un *)addr;
+		if(strlen(address + 5) >= sizeof un->sun_path) return -1;
+		un->sun_family = AF_UNIX;
+		strcpy(un->sun_path, address + 5);
+		*len = sizeof *un;
+		return AF_UNIX;
+	}
+	if(strncmp(address, "tcp:", 4) == 0) address += 4;
+	const char *colon = strrchr(address, ':');
+	if(!colon) return -1;
+	char host[colon - address + 1];
+	memcpy(host, address, colon - address);
+	host[colon - address] = 0;
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE }, *ai;
+	if(getaddrinfo(*host ? host : NULL, colon + 1, &hints, &ai)) return -1;
+	memcpy(addr, ai->ai_addr, ai->ai_addrlen);
+	*len = ai->ai_addrlen;
+	int family = ai->ai_family;
+	freeaddrinfo(ai);
+	return family;
+}
+
+// Returns a connected socket, -1 if the worker can't be reached within timeout milliseconds
+static inline int dist_connect(const char *address, int timeout) {
+	struct sockaddr_storage addr;
+	socklen_t len;
+	int family = dist_parse_address(address, &addr, &len);
+	if(family < 0) return -1;
+	int fd = socket(family, SOCK_STREAM, 0);
+	if(fd == -1) return -1;
+	int flags = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	if(connect(fd, (struct sockaddr *)&addr, len) < 0) {
+		if(errno != EINPROGRESS) {
+			close(fd);
+			return -1;
+		}
+		struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+		int e = 0;
+		socklen_t e_len = sizeof e;
+		if(poll(&pfd, 1, timeout) != 1 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &e, &e_len) < 0 || e) {
+			close(fd);
+			return -1;
+		}
+	}
+	fcntl(fd, F_SETFL, flags);
+	if(family != AF_UNIX) {
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	}
+	return fd;
+}
+
+static inline int dist_listen(const char *address) {
+	struct sockaddr_storage addr;
+	socklen_t len;
+	int family = dist_parse_address(address, &addr, &len);
+	if(family < 0) return -1;
+	int fd = socket(family, SOCK_STREAM, 0);
+	if(fd == -1) return -1;
+	if(family == AF_UNIX) unlink(((struct sockaddr_un *)&addr)->sun_path);
+	else {
+		int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+	}
+	if(bind(fd, (struct sockaddr *)&addr, len) < 0 || listen(fd, 64) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+#endif
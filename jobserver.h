@@ -0,0 +1,125 @@
+/*	GNU make jobserver client shared by cc2cl and cl2cc
+	Copyright 2015 libdll.so
+
+	This program is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation; either version 2 of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+*/
+
+/*
+	Every process started by make owns one implicit job slot; each extra job
+	needs a token taken from the jobserver named in MAKEFLAGS.  Tokens are
+	only ever taken without blocking, so a wrapper falls back to running
+	serially instead of waiting on make.
+*/
+
+#ifndef _JOBSERVER_H
+#define _JOBSERVER_H
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#define JOBSERVER_MAX_TOKENS 256
+
+static unsigned int jobserver_tokens_count;
+#ifdef _WIN32
+static void *jobserver_semaphore;
+#else
+static int jobserver_write_fd = -1;
+static char jobserver_tokens[JOBSERVER_MAX_TOKENS];
+#endif
+
+// Returns the value of the last --jobserver-auth= (or --jobserver-fds=) in MAKEFLAGS, NULL if none
+static inline char *jobserver_get_auth() {
+	const char *makeflags = getenv("MAKEFLAGS");
+	if(!makeflags) return NULL;
+	const char *auth = NULL, *p = makeflags;
+	while((p = strstr(p, "--jobserver-"))) {
+		p += 12;
+		if(strncmp(p, "auth=", 5) == 0) auth = p + 5;
+		else if(strncmp(p, "fds=", 4) == 0) auth = p + 4;
+	}
+	if(!auth) return NULL;
+	size_t len = strcspn(auth, " 	");
+	char *r = malloc(len + 1);
+	if(!r) return NULL;
+	memcpy(r, auth, len);
+	r[len] = 0;
+	return r;
+}
+
+#ifndef _WIN32
+// Opens a private non-blocking description, so make's own descriptor keeps its flags
+static inline int jobserver_open(const char *auth) {
+	if(strncmp(auth, "fifo:", 5) == 0) {
+		if(jobserver_write_fd == -1) jobserver_write_fd = open(auth + 5, O_WRONLY);
+		if(jobserver_write_fd == -1) return -1;
+		return open(auth + 5, O_RDONLY | O_NONBLOCK);
+	}
+	int read_fd, write_fd;
+	if(sscanf(auth, "%d,%d", &read_fd, &write_fd) != 2) return -1;
+	// The descriptors are not inherited unless make considers us a sub-make
+	if(read_fd < 0 || write_fd < 0 || fcntl(read_fd, F_GETFD) < 0 || fcntl(write_fd, F_GETFD) < 0) return -1;
+	jobserver_write_fd = write_fd;
+	char path[32];
+	sprintf(path, "/proc/self/fd/%d", read_fd);
+	return open(path, O_RDONLY | O_NONBLOCK);
+}
+#endif
+
+// Takes up to max tokens without blocking; returns the number taken, 0 if there is no jobserver
+static inline unsigned int jobserver_acquire(unsigned int max) {
+	if(max > JOBSERVER_MAX_TOKENS - jobserver_tokens_count) max = JOBSERVER_MAX_TOKENS - jobserver_tokens_count;
+	if(!max) return 0;
+	char *auth = jobserver_get_auth();
+	if(!auth) return 0;
+	unsigned int n = 0;
+#ifdef _WIN32
+	if(!jobserver_semaphore) jobserver_semaphore = OpenSemaphoreA(SYNCHRONIZE | SEMAPHORE_MODIFY_STATE, 0, auth);
+	if(jobserver_semaphore) {
+		while(n < max && WaitForSingleObject(jobserver_semaphore, 0) == WAIT_OBJECT_0) n++;
+	}
+#else
+	int fd = jobserver_open(auth);
+	if(fd != -1) {
+		ssize_t s;
+		while(n < max && (s = read(fd, jobserver_tokens + jobserver_tokens_count + n, max - n)) > 0) n += s;
+		close(fd);
+	}
+#endif
+	free(auth);
+	jobserver_tokens_count += n;
+	return n;
+}
+
+// Returns every token taken so far
+static inline void jobserver_release() {
+	if(!jobserver_tokens_count) return;
+#ifdef _WIN32
+	ReleaseSemaphore(jobserver_semaphore, jobserver_tokens_count, NULL);
+#else
+	const char *p = jobserver_tokens;
+	size_t len = jobserver_tokens_count;
+	while(len) {
+		ssize_t s = write(jobserver_write_fd, p, len);
+		if(s < 0) {
+			if(errno == EINTR) continue;
+			perror("jobserver");
+			break;
+		}
+		p += s;
+		len -= s;
+	}
+#endif
+	jobserver_tokens_count = 0;
+}
+
+#endif
@@ -6,53 +6,280 @@
 	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
 */
 
+/*	Takes the command line of link.exe, response files expanded, and runs
+	it as cl -link, with cl from CL_LOCATION.  With LINK2CL_LLD set to the
+	lld-link to use, that links by itself instead, with /threads: as many
+	as there are processors, or jobserver tokens under make.  A command
+	line too long for CreateProcess is handed over in a response file.
+	With LINK_CACHE, see linkcache.h, a link that has nothing new to do
+	is skipped; LINK and _LINK_ count as options.
+*/
+
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <sys/wait.h>
+#include <spawn.h>
+#include <unistd.h>
+#endif
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
+#include "jobserver.h"
+#include "linkcache.h"
+#include "respfile.h"
 
-#define BUF_SIZE 1024
-
-char *GetLineFromFile(char *line, const char *file) {
-	char buffer[BUF_SIZE];
-	void *f = CreateFileA(file, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-	if(!f) return NULL;
-	unsigned long int read_size;
-	if(!ReadFile(f, (char *)buffer, BUF_SIZE, &read_size, NULL)) return NULL;
-	//buffer[read_size / sizeof(wchar_t)] = 0;
-	//wcstombs(line, buffer + 1, read_size);
-	memcpy(line, buffer, read_size);
-	//int r = read_size;
-	char *p = line;
-	while(*p) {
-		if(*p++ == '\r' && *p == '\n') {
-			char *np = p;
-			p[-1] = ' ';
-			//while((*np = *++np));
-			while((np[0] = np[1])) np++;
-		}
+// CreateProcess takes at most 32767 characters
+#define MAX_COMMAND_LINE 32000
+
+#ifndef _WIN32
+extern char **environ;
+#endif
+
+static unsigned int get_thread_count() {
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	unsigned int n = info.dwNumberOfProcessors;
+#else
+	long int count = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int n = count > 0 ? count : 1;
+#endif
+	char *auth = jobserver_get_auth();
+	if(auth) {
+		free(auth);
+		n = 1 + jobserver_acquire(n - 1);
 	}
-	return line;
+	return n;
 }
 
-int APIENTRY WinMain(HINSTANCE instance, HINSTANCE prev_instance, char *command_line, int show) {
-	puts(command_line);
-	//while(*command_line != ' ') if(!*command_line++) return -1;
+static int has_option(char **argv, const char *name) {
+	size_t len = strlen(name);
+	while(*++argv) {
+		if((**argv == '/' || **argv == '-') && strncasecmp(*argv + 1, name, len) == 0) return 1;
+	}
+	return 0;
+}
+
+// Writes the arguments to a new response file, and returns '@' and its name
+static char *write_response_file(char **argv) {
+#ifdef _WIN32
+	char directory[PATH_MAX + 1], name[PATH_MAX + 1];
+	if(!GetTempPathA(sizeof directory, directory) || !GetTempFileNameA(directory, "lnk", 0, name)) {
+		fprintf(stderr, "cannot create a response file, error %lu\n", GetLastError());
+		return NULL;
+	}
+	FILE *f = fopen(name, "w");
+#else
+	const char *directory = getenv("TMPDIR");
+	if(!directory || !*directory) directory = "/tmp";
+	char name[strlen(directory) + 14 + 1];
+	strcpy(name, directory);
+	strcat(name, "/link2clXXXXXX");
+	int fd = mkstemp(name);
+	FILE *f = fd == -1 ? NULL : fdopen(fd, "w");
+#endif
+	if(!f) {
+		perror(name);
+		return NULL;
+	}
+	char *content = respfile_join(argv);
+	fputs(content, f);
+	free(content);
+	if(fclose(f) == EOF) {
+		perror(name);
+		remove(name);
+		return NULL;
+	}
+	char *p = malloc(1 + strlen(name) + 1);
+	if(!p) {
+		perror(NULL);
+		abort();
+	}
+	*p = '@';
+	strcpy(p + 1, name);
+	return p;
+}
+
+static int run(char **argv) {
+#ifdef _WIN32
 	STARTUPINFOA si = { .cb = sizeof(STARTUPINFOA) };
 	PROCESS_INFORMATION pi;
-	char cl_command_line[13 + BUF_SIZE];
-	strcpy(cl_command_line, "cl.exe -link ");
-	if(*command_line == '@') {
-		if(!GetLineFromFile(cl_command_line + 13, command_line + 1)) {
-			fprintf(stderr, "failed to read command file %s, %lu\n", command_line + 1, GetLastError());
-			return 1;
-		}
-	} else strcpy(cl_command_line + 13, command_line);
-	puts(cl_command_line);
-	while(!CreateProcessA(NULL, cl_command_line, NULL, NULL, 0, 0, NULL, NULL, &si, &pi)) {
+	char *command_line = respfile_join(argv);
+	if(!CreateProcessA(NULL, command_line, NULL, NULL, 0, 0, NULL, NULL, &si, &pi)) {
 		fprintf(stderr, "CreateProcessA failed, error %lu\n", GetLastError());
+		free(command_line);
 		return 1;
 	}
+	free(command_line);
 	unsigned long int r;
 	WaitForSingleObject(pi.hProcess, INFINITE);
 	GetExitCodeProcess(pi.hProcess, &r);
+	CloseHandle(pi.hThread);
+	CloseHandle(pi.hProcess);
 	return r;
+#else
+	pid_t pid;
+	int e = posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ);
+	if(e) {
+		fprintf(stderr, "cannot run %s, %s\n", argv[0], strerror(e));
+		return 127;
+	}
+	int status;
+	while(waitpid(pid, &status, 0) < 0) {
+		if(errno != EINTR) {
+			perror("waitpid");
+			return 1;
+		}
+	}
+	if(WIFSIGNALED(status)) {
+		fprintf(stderr, "%s terminated with signal %d\n", argv[0], WTERMSIG(status));
+		return WTERMSIG(status) + 126;
+	}
+	return WEXITSTATUS(status);
+#endif
+}
+
+// Returns file with its extension replaced by suffix
+static char *replace_extension(const char *file, const char *suffix) {
+	size_t len = strlen(file), i = len;
+	while(i > 0 && file[i - 1] != '.' && file[i - 1] != '/' && file[i - 1] != '\\' && file[i - 1] != ':') i--;
+	if(i > 0 && file[i - 1] == '.') len = i - 1;
+	char *p = malloc(len + strlen(suffix) + 1);
+	if(!p) {
+		perror(NULL);
+		abort();
+	}
+	memcpy(p, file, len);
+	strcpy(p + len, suffix);
+	return p;
+}
+
+/*	Returns the /OUT file, NULL without one, in which case the link isn't
+	cached.  The import library, its .exp and the PDB are checked as outputs
+	too; the .ilk, the map and the manifest files are not.
+*/
+static const char *add_link_to_cache(struct linkcache *cache, int argc, char **argv, const char *linker) {
+	const char *output = NULL, *implib = NULL, *pdb = NULL, *lib = getenv("LIB");
+	const char *directories[argc + (lib ? strlen(lib) / 2 + 1 : 0)];
+	unsigned int directories_count = 0;
+	char lib_buffer[lib ? strlen(lib) + 1 : 1];
+	char **v;
+	int debug = 0;
+	linkcache_add_tool(cache, linker);
+	// link.exe and lld-link take options from these too
+	linkcache_add_environment(cache, "LINK");
+	linkcache_add_environment(cache, "_LINK_");
+	// The /LIBPATH directories come before those in LIB
+	for(v = argv + 1; *v; v++) {
+		const char *arg = *v + 1;
+		if((**v == '/' || **v == '-') && strncasecmp(arg, "libpath:", 8) == 0) directories[directories_count++] = arg + 8;
+	}
+	if(lib) {
+		char *p = strcpy(lib_buffer, lib);
+		// Empty fields are skipped, which keeps the fields within strlen(lib) / 2 + 1
+		while(p) {
+			char *s = p;
+			if((p = strchr(p, ';'))) *p++ = 0;
+			if(*s) directories[directories_count++] = s;
+		}
+	}
+	for(v = argv + 1; *v; v++) {
+		const char *arg = *v + 1;
+		linkcache_add_string(cache, *v);
+		if(**v == '/' || **v == '-') {
+			if(strncasecmp(arg, "out:", 4) == 0) output = arg + 4;
+			else if(strncasecmp(arg, "implib:", 7) == 0) implib = arg + 7;
+			else if(strncasecmp(arg, "pdb:", 4) == 0) pdb = arg + 4;
+			else if(strcasecmp(arg, "debug") == 0 || strncasecmp(arg, "debug:", 6) == 0) debug = strcasecmp(arg, "debug:none") != 0;
+			else if(strncasecmp(arg, "def:", 4) == 0 || strncasecmp(arg, "natvis:", 7) == 0 ||
+			strncasecmp(arg, "manifestinput:", 14) == 0 || strncasecmp(arg, "order:@", 7) == 0) {
+				const char *file = strchr(arg, ':') + 1;
+				if(*file == '@') file++;
+				if(linkcache_add_file(cache, file) < 0) cache->usable = 0;
+			}
+			continue;
+		}
+		size_t len = strlen(*v);
+		int is_library = len > 4 && strcasecmp(*v + len - 4, ".lib") == 0;
+		if(linkcache_add_found_file(cache, *v, directories, directories_count) < 0 && !is_library) cache->usable = 0;
+	}
+	if(!output) return NULL;
+	linkcache_add_string(cache, output);
+	// Named after the output unless given
+	linkcache_add_output(cache, implib ? implib : replace_extension(output, ".lib"));
+	linkcache_add_output(cache, replace_extension(implib ? implib : output, ".exp"));
+	if(pdb) linkcache_add_output(cache, pdb);
+	else if(debug) linkcache_add_output(cache, replace_extension(output, ".pdb"));
+	return output;
+}
+
+static int link2cl(int argc, char **argv) {
+	if(!(argv = respfile_expand(&argc, argv))) return 1;
+	struct respfile_argv command = { NULL, 0, 0 };
+	const char *lld = getenv("LINK2CL_LLD");
+	char threads[9 + 10 + 1];
+	int i;
+	if(lld && *lld) {
+		respfile_add(&command, (char *)lld);
+		if(!has_option(argv, "threads")) {
+			sprintf(threads, "/threads:%u", get_thread_count());
+			respfile_add(&command, threads);
+		}
+	} else {
+		const char *cl = getenv("CL_LOCATION");
+#ifdef _WIN32
+		respfile_add(&command, (char *)(cl && *cl ? cl : "cl.exe"));
+#else
+		respfile_add(&command, (char *)(cl && *cl ? cl : "cl"));
+#endif
+		respfile_add(&command, "-link");
+	}
+	int first_link_arg = command.count;
+	for(i = 1; i < argc; i++) respfile_add(&command, argv[i]);
+
+	struct linkcache cache;
+	const char *output = NULL;
+	linkcache_begin(&cache);
+	if(cache.mode && (output = add_link_to_cache(&cache, argc, argv, command.v[0])) && linkcache_is_up_to_date(&cache, output)) {
+		printf("%s is up to date\n", output);
+		jobserver_release();
+		return 0;
+	}
+
+	char *command_line = respfile_join(command.v);
+	char *response_file = NULL;
+	if(strlen(command_line) > MAX_COMMAND_LINE) {
+		if(!(response_file = write_response_file(command.v + first_link_arg))) {
+			jobserver_release();
+			return 1;
+		}
+		command.count = first_link_arg;
+		respfile_add(&command, response_file);
+		free(command_line);
+		command_line = respfile_join(command.v);
+	}
+	puts(command_line);
+	fflush(stdout);
+	free(command_line);
+	int r = run(command.v);
+	if(!r && output) linkcache_commit(&cache, output);
+	if(response_file) {
+		remove(response_file + 1);
+		free(response_file);
+	}
+	jobserver_release();
+	return r;
+}
+
+#ifdef _WIN32
+int APIENTRY WinMain(HINSTANCE instance, HINSTANCE prev_instance, char *command_line, int show) {
+	return link2cl(__argc, __argv);
+}
+#else
+int main(int argc, char **argv) {
+	return link2cl(argc, argv);
 }
+#endif
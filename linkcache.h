@@ -0,0 +1,256 @@
+/*	Link avoidance shared by cc2cl and link2cl
+	Copyright 2015 libdll.so
+
+	This program is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation; either version 2 of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+*/
+
+/*
+	With LINK_CACHE set to "stat" or "content", a link is summed up in a key:
+	its options, its output name, the linker, the environment variables it
+	reads options from, and every input file, by size and modification time
+	or by content.  After a successful link the key is written to
+	<output>.linkcache with the size and time of the output and of the other
+	files the link may write, such as the import library and the PDB, or
+	that it didn't write them; the next link with the same key is skipped
+	while all of them are still as it left them.  A link with an input that
+	can't be found always runs, except for libraries found nowhere, which
+	are taken to come with the toolchain like the default libraries the
+	objects name, and change no more often.
+*/
+
+#ifndef _LINKCACHE_H
+#define _LINKCACHE_H
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#define LINKCACHE_STAT 1
+#define LINKCACHE_CONTENT 2
+#define LINKCACHE_VERSION 2
+#define LINKCACHE_MAX_OUTPUTS 8
+#define LINKCACHE_READ_SIZE (1024 * 1024)
+
+struct linkcache {
+	uint64_t key;
+	int mode;		// 0 when LINK_CACHE is unset
+	int usable;		// Cleared for an input that can't be read
+	const char *outputs[LINKCACHE_MAX_OUTPUTS];		// Besides the main one
+	unsigned int outputs_count;
+};
+
+static inline uint64_t linkcache_mix(uint64_t h, uint64_t v) {
+	h ^= v * 0x9e3779b97f4a7c15ULL;
+	h = (h << 31 | h >> 33) * 0xbf58476d1ce4e5b9ULL;
+	return h ^ h >> 29;
+}
+
+static inline void linkcache_begin(struct linkcache *cache) {
+	const char *mode = getenv("LINK_CACHE");
+	cache->key = LINKCACHE_VERSION;
+	cache->usable = 1;
+	cache->outputs_count = 0;
+	if(!mode || !*mode) cache->mode = 0;
+	else if(strcmp(mode, "content") == 0) cache->mode = LINKCACHE_CONTENT;
+	else {
+		if(strcmp(mode, "stat")) fprintf(stderr, "warning: unknown LINK_CACHE mode '%s', using 'stat'\n", mode);
+		cache->mode = LINKCACHE_STAT;
+	}
+}
+
+static inline void linkcache_add_string(struct linkcache *cache, const char *s) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t len = strlen(s), i;
+	for(i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 0x100000001b3ULL;
+	cache->key = linkcache_mix(linkcache_mix(cache->key, len), h);
+}
+
+// Size and modification time of file; -1 if it can't be found
+static inline int linkcache_stat(const char *file, uint64_t *size, uint64_t *mtime) {
+#ifdef _WIN32
+	WIN32_FILE_ATTRIBUTE_DATA attr;
+	if(!GetFileAttributesExA(file, GetFileExInfoStandard, &attr)) return -1;
+	if(attr.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) return -1;
+	*size = (uint64_t)attr.nFileSizeHigh << 32 | attr.nFileSizeLow;
+	*mtime = (uint64_t)attr.ftLastWriteTime.dwHighDateTime << 32 | attr.ftLastWriteTime.dwLowDateTime;
+#else
+	struct stat st;
+	if(stat(file, &st) < 0 || S_ISDIR(st.st_mode)) return -1;
+	*size = st.st_size;
+	*mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+	return 0;
+}
+
+// Eight bytes at a time, which keeps up with reading the file
+static inline int linkcache_add_content(struct linkcache *cache, const char *file) {
+	FILE *f = fopen(file, "rb");
+	if(!f) return -1;
+	char *buffer = malloc(LINKCACHE_READ_SIZE);
+	if(!buffer) {
+		perror(NULL);
+		abort();
+	}
+	uint64_t h = cache->key, total = 0;
+	size_t s;
+	while((s = fread(buffer, 1, LINKCACHE_READ_SIZE, f)) > 0) {
+		size_t i;
+		for(i = 0; i + 8 <= s; i += 8) {
+			uint64_t w;
+			memcpy(&w, buffer + i, 8);
+			h = linkcache_mix(h, w);
+		}
+		if(i < s) {
+			uint64_t w = 0;
+			memcpy(&w, buffer + i, s - i);
+			h = linkcache_mix(h, w);
+		}
+		total += s;
+	}
+	int e = ferror(f);
+	fclose(f);
+	free(buffer);
+	if(e) return -1;
+	cache->key = linkcache_mix(h, total);
+	return 0;
+}
+
+// Adds file by name and either its size and time or its content; -1 if it can't be read
+static inline int linkcache_add_file(struct linkcache *cache, const char *file) {
+	uint64_t size, mtime;
+	if(linkcache_stat(file, &size, &mtime) < 0) return -1;
+	linkcache_add_string(cache, file);
+	if(cache->mode == LINKCACHE_CONTENT) return linkcache_add_content(cache, file);
+	cache->key = linkcache_mix(linkcache_mix(cache->key, size), mtime);
+	return 0;
+}
+
+// Adds the first of directory/name that exists, or name alone; -1 if none does
+static inline int linkcache_add_found_file(struct linkcache *cache, const char *name, const char **directories, unsigned int count) {
+	if(linkcache_add_file(cache, name) == 0) return 0;
+	size_t len = strlen(name);
+	unsigned int i;
+	for(i = 0; i < count; i++) {
+		size_t directory_len = strlen(directories[i]);
+		if(!directory_len) continue;
+		char path[directory_len + 1 + len + 1];
+		memcpy(path, directories[i], directory_len);
+		if(path[directory_len - 1] != '/' && path[directory_len - 1] != '\\') path[directory_len++] = '/';
+		strcpy(path + directory_len, name);
+		if(linkcache_add_file(cache, path) == 0) return 0;
+	}
+	return -1;
+}
+
+// The linker by its size and time when it is a file, by name when it is looked up in PATH
+static inline void linkcache_add_tool(struct linkcache *cache, const char *tool) {
+	uint64_t size, mtime;
+	linkcache_add_string(cache, tool);
+	if(linkcache_stat(tool, &size, &mtime) == 0) cache->key = linkcache_mix(linkcache_mix(cache->key, size), mtime);
+}
+
+// A variable as name=value, or name alone when unset
+static inline void linkcache_add_environment(struct linkcache *cache, const char *name) {
+	const char *value = getenv(name);
+	linkcache_add_string(cache, name);
+	cache->key = linkcache_mix(cache->key, value != NULL);
+	if(value) linkcache_add_string(cache, value);
+}
+
+// Another file the link may write; the name has to live as long as the cache
+static inline void linkcache_add_output(struct linkcache *cache, const char *output) {
+	if(cache->outputs_count == LINKCACHE_MAX_OUTPUTS) {
+		cache->usable = 0;
+		return;
+	}
+	cache->outputs[cache->outputs_count++] = output;
+}
+
+static inline char *linkcache_get_manifest_name(const char *output) {
+	char *p = malloc(strlen(output) + 10 + 1);
+	if(!p) {
+		perror(NULL);
+		abort();
+	}
+	strcpy(p, output);
+	strcat(p, ".linkcache");
+	return p;
+}
+
+// Whether output and the other outputs are what the last link with the same key left
+static inline int linkcache_is_up_to_date(const struct linkcache *cache, const char *output) {
+	if(!cache->mode || !cache->usable) return 0;
+	char *manifest = linkcache_get_manifest_name(output);
+	FILE *f = fopen(manifest, "r");
+	free(manifest);
+	if(!f) return 0;
+	unsigned long long int key;
+	unsigned int count, i;
+	int r = fscanf(f, "linkcache %llx %u", &key, &count) == 2 && key == cache->key && count == 1 + cache->outputs_count;
+	for(i = 0; r && i < count; i++) {
+		int exists;
+		unsigned long long int size, mtime;
+		uint64_t output_size, output_mtime;
+		const char *file = i ? cache->outputs[i - 1] : output;
+		int found = linkcache_stat(file, &output_size, &output_mtime) == 0;
+		r = fscanf(f, "%d %llu %llu", &exists, &size, &mtime) == 3 && exists == found && (i || found) &&
+			(!found || (output_size == size && output_mtime == mtime));
+	}
+	fclose(f);
+	return r;
+}
+
+// Call after a successful link; the manifest is replaced whole, so a concurrent reader never sees half of it
+static inline void linkcache_commit(const struct linkcache *cache, const char *output) {
+	if(!cache->mode) return;
+	char *manifest = linkcache_get_manifest_name(output);
+	uint64_t size, mtime;
+	if(!cache->usable || linkcache_stat(output, &size, &mtime) < 0) {
+		remove(manifest);
+		free(manifest);
+		return;
+	}
+	char temp[strlen(manifest) + 1 + 10 + 1];
+#ifdef _WIN32
+	sprintf(temp, "%s.%lu", manifest, GetCurrentProcessId());
+#else
+	sprintf(temp, "%s.%u", manifest, (unsigned int)getpid());
+#endif
+	FILE *f = fopen(temp, "w");
+	if(!f) {
+		remove(manifest);
+		free(manifest);
+		return;
+	}
+	unsigned int i;
+	fprintf(f, "linkcache %016llx %u\n", (unsigned long long int)cache->key, 1 + cache->outputs_count);
+	for(i = 0; i <= cache->outputs_count; i++) {
+		// An output the link didn't write has to stay missing
+		int found = linkcache_stat(i ? cache->outputs[i - 1] : output, &size, &mtime) == 0;
+		if(!found) size = mtime = 0;
+		fprintf(f, "%d %llu %llu\n", found, (unsigned long long int)size, (unsigned long long int)mtime);
+	}
+	if(fclose(f) == EOF ||
+#ifdef _WIN32
+	!MoveFileExA(temp, manifest, MOVEFILE_REPLACE_EXISTING)
+#else
+	rename(temp, manifest) < 0
+#endif
+	) {
+		remove(temp);
+		remove(manifest);
+	}
+	free(manifest);
+}
+
+#endif
@@ -0,0 +1,165 @@
+/*	Invocation recorder shared by cc2cl and cl2cc
+	Copyright 2015 libdll.so
+
+	This program is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation; either version 2 of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+*/
+
+/*
+	When BUILD_RECORD_FILE is set, every invocation appends one record to
+	that file with a single write, so concurrent wrappers never interleave.
+	A record, in host byte order, is
+
+		struct record_header;
+		cwd, argv, translated command, environment: each a uint32_t
+			count followed by that many NUL-terminated strings
+
+	The replay tool reads these logs back.
+*/
+
+#ifndef _RECORD_H
+#define _RECORD_H
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include "stats.h"
+
+#define RECORD_MAGIC 0x31524943		// "CIR1"
+
+#define RECORD_CC2CL 0
+#define RECORD_CL2CC 1
+
+struct record_header {
+	uint32_t magic;
+	uint32_t size;			// Of the whole record, including this header
+	uint8_t tool;
+	uint8_t reserved[3];
+	int32_t status;
+	uint64_t start_time;		// Microseconds since the Epoch
+	uint64_t total_time;		// In microseconds
+	uint64_t compile_time;		// In microseconds
+};
+
+// Variables that change what the wrappers or the compilers do
+static const char *record_environment_names[] = {
+	"INCLUDE", "LIB", "LIBPATH", "PATH", "CL", "_CL_", "LINK", "_LINK_",
+	"CL_LOCATION", "VS_PATH", "VSINSTALLDIR",
+	"CC", "CC_LOCATION", "CPATH", "C_INCLUDE_PATH", "CPLUS_INCLUDE_PATH", "LIBRARY_PATH"
+};
+
+static char *record_buffer;
+static size_t record_length;
+static size_t record_max_length;
+static uint64_t record_start_time;
+static int record_enabled = -1;
+
+static inline void record_append(const void *data, size_t len) {
+	if(record_length + len > record_max_length) {
+		while(record_length + len > record_max_length) record_max_length = record_max_length ? record_max_length * 2 : 4096;
+		record_buffer = realloc(record_buffer, record_max_length);
+		if(!record_buffer) {
+			perror(NULL);
+			abort();
+		}
+	}
+	memcpy(record_buffer + record_length, data, len);
+	record_length += len;
+}
+
+static inline void record_append_strings(int count, char **strings) {
+	uint32_t n = count;
+	record_append(&n, sizeof n);
+	while(count--) {
+		record_append(*strings, strlen(*strings) + 1);
+		strings++;
+	}
+}
+
+static inline void record_begin(int tool, int argc, char **argv) {
+	const char *file = getenv("BUILD_RECORD_FILE");
+	record_enabled = file && *file;
+	if(!record_enabled) return;
+	struct record_header header = { .magic = RECORD_MAGIC, .tool = tool };
+#ifdef _WIN32
+	FILETIME ft;
+	GetSystemTimeAsFileTime(&ft);
+	header.start_time = (((uint64_t)ft.dwHighDateTime << 32 | ft.dwLowDateTime) - 116444736000000000ULL) / 10;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	header.start_time = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+	record_start_time = stats_now();
+	record_append(&header, sizeof header);
+	char cwd[PATH_MAX + 1], *p = cwd;
+#ifdef _WIN32
+	if(!GetCurrentDirectoryA(sizeof cwd, cwd)) *cwd = 0;
+#else
+	if(!getcwd(cwd, sizeof cwd)) *cwd = 0;
+#endif
+	record_append_strings(1, &p);
+	record_append_strings(argc, argv);
+}
+
+// The command that the wrapper is about to run
+static inline void record_command(int argc, char **argv) {
+	if(record_enabled != 1) return;
+	record_append_strings(argc, argv);
+	int i;
+	uint32_t count = 0;
+	size_t count_offset = record_length;
+	record_append(&count, sizeof count);
+	for(i = 0; i < sizeof record_environment_names / sizeof(char *); i++) {
+		const char *name = record_environment_names[i];
+		const char *value = getenv(name);
+		if(!value) continue;
+		size_t name_len = strlen(name);
+		record_append(name, name_len);
+		record_append("=", 1);
+		record_append(value, strlen(value) + 1);
+		count++;
+	}
+	memcpy(record_buffer + count_offset, &count, sizeof count);
+	record_enabled = 2;
+}
+
+static inline void record_end(int status) {
+	if(record_enabled != 2) return;
+	record_enabled = 0;
+	struct record_header *header = (struct record_header *)record_buffer;
+	header->size = record_length;
+	header->status = status;
+	header->total_time = stats_now() - record_start_time;
+	header->compile_time = stats_compile_time;
+	const char *file = getenv("BUILD_RECORD_FILE");
+#ifdef _WIN32
+	void *fh = CreateFileA(file, FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(fh == INVALID_HANDLE_VALUE) {
+		fprintf(stderr, "warning: cannot open %s, error %lu\n", file, GetLastError());
+		return;
+	}
+	unsigned long int written;
+	if(!WriteFile(fh, record_buffer, record_length, &written, NULL) || written != record_length) {
+		fprintf(stderr, "warning: cannot write %s, error %lu\n", file, GetLastError());
+	}
+	CloseHandle(fh);
+#else
+	int fd = open(file, O_WRONLY | O_APPEND | O_CREAT, 0666);
+	if(fd == -1 || write(fd, record_buffer, record_length) != record_length) {
+		fprintf(stderr, "warning: cannot write %s, %s\n", file, strerror(errno));
+	}
+	if(fd != -1) close(fd);
+#endif
+}
+
+#endif
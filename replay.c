@@ -0,0 +1,287 @@
+/*	replay
+	Copyright 2015 libdll.so
+
+	This program is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation; either version 2 of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+*/
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include "record.h"
+
+struct invocation {
+	struct record_header header;
+	const char *cwd;
+	char **argv;
+	char **command;
+	char **environment;
+	pid_t pid;
+	uint64_t start_time;
+};
+
+static const char *program_name;
+
+static void __attribute__((__noreturn__)) usage() {
+	fprintf(stderr, "Usage: %s [-l] [-t] [-q] [-p] [-j <jobs>] [-s <stub compiler>] [-w <wrapper>] [-C <directory>] <log file>\n", program_name);
+	fputs("	-l	List the records instead of running them\n"
+		"	-t	Run the translated command instead of the wrapper\n"
+		"	-q	Discard the output of the commands\n"
+		"	-p	Also restore the recorded PATH\n"
+		"	-j	Run up to <jobs> commands at once\n"
+		"	-s	Use <stub compiler> as CL_LOCATION, CC_LOCATION and CC, or as the command with -t\n"
+		"	-w	Run <wrapper> instead of the recorded one\n"
+		"	-C	Run every command in <directory> instead of the recorded one\n", stderr);
+	exit(-1);
+}
+
+static void *xmalloc(size_t size) {
+	void *r = malloc(size);
+	if(!r) {
+		perror(NULL);
+		abort();
+	}
+	return r;
+}
+
+// Returns a NULL terminated vector pointing into the record
+static char **get_strings(const char **p, const char *end) {
+	uint32_t count;
+	if(end - *p < sizeof count) return NULL;
+	memcpy(&count, *p, sizeof count);
+	*p += sizeof count;
+	char **v = xmalloc((count + 1) * sizeof(char *));
+	uint32_t i;
+	for(i = 0; i < count; i++) {
+		const char *s = memchr(*p, 0, end - *p);
+		if(!s) {
+			free(v);
+			return NULL;
+		}
+		v[i] = (char *)*p;
+		*p = s + 1;
+	}
+	v[count] = NULL;
+	return v;
+}
+
+// cl2cc recorded its command as a single command line before it kept an argv
+static char **split_command_line(const char *command_line) {
+	size_t len = strlen(command_line);
+	char *buffer = xmalloc(len + 1), *p = buffer;
+	char **v = xmalloc((len / 2 + 2) * sizeof(char *));
+	int n = 0;
+	while(*command_line) {
+		while(*command_line == ' ' || *command_line == '	') command_line++;
+		if(!*command_line) break;
+		v[n++] = p;
+		int quoted = 0;
+		while(*command_line && (quoted || (*command_line != ' ' && *command_line != '	'))) {
+			if(*command_line == '\"') quoted = !quoted;
+			else *p++ = *command_line;
+			command_line++;
+		}
+		*p++ = 0;
+	}
+	v[n] = NULL;
+	return v;
+}
+
+static void print_strings(const char *title, char **v) {
+	printf("	%s:", title);
+	while(*v) printf(strchr(*v, ' ') ? " \"%s\"" : " %s", *v), v++;
+	putchar('\n');
+}
+
+int main(int argc, char **argv) {
+	int list = 0, translated = 0, quiet = 0, restore_path = 0;
+	unsigned int jobs = 1;
+	const char *stub = NULL, *wrapper = NULL, *directory = NULL, *log_file = NULL;
+	char **v = argv;
+	program_name = argv[0];
+	while(*++v) {
+		if(**v != '-' || !(*v)[1]) {
+			if(log_file) usage();
+			log_file = *v;
+			continue;
+		}
+		const char *arg = *v + 1;
+		const char *value = arg[1] ? arg + 1 : v[1];
+		if(arg[1] && !strchr("jswC", *arg)) usage();
+		switch(*arg) {
+			case 'l':
+				list = 1;
+				break;
+			case 't':
+				translated = 1;
+				break;
+			case 'q':
+				quiet = 1;
+				break;
+			case 'p':
+				restore_path = 1;
+				break;
+			case 'j':
+				if(!value || (jobs = atoi(value)) < 1) usage();
+				break;
+			case 's':
+				if(!(stub = value)) usage();
+				break;
+			case 'w':
+				if(!(wrapper = value)) usage();
+				break;
+			case 'C':
+				if(!(directory = value)) usage();
+				break;
+			default:
+				usage();
+		}
+		if(strchr("jswC", *arg) && !arg[1]) v++;
+	}
+	if(!log_file) usage();
+
+	int fd = open(log_file, O_RDONLY);
+	struct stat st;
+	if(fd == -1 || fstat(fd, &st) < 0) {
+		perror(log_file);
+		return 1;
+	}
+	if(!st.st_size) return 0;
+	const char *log = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(log == MAP_FAILED) {
+		perror(log_file);
+		return 1;
+	}
+	close(fd);
+
+	struct invocation *invocations = NULL;
+	size_t count = 0, max_count = 0;
+	const char *p = log, *end = log + st.st_size;
+	while(end - p >= sizeof(struct record_header)) {
+		// Records are packed, so a header may not be aligned in the mapping
+		struct record_header header;
+		const char *record_start = p;
+		memcpy(&header, p, sizeof header);
+		if(header.magic != RECORD_MAGIC || header.size < sizeof header || header.size > end - p) {
+			fprintf(stderr, "%s: %s: bad record at offset %ld\n", argv[0], log_file, (long int)(p - log));
+			return 1;
+		}
+		const char *record_end = p + header.size;
+		p += sizeof header;
+		if(count == max_count) {
+			max_count = max_count ? max_count * 2 : 1024;
+			invocations = realloc(invocations, max_count * sizeof *invocations);
+			if(!invocations) {
+				perror(NULL);
+				return 1;
+			}
+		}
+		struct invocation *invocation = invocations + count++;
+		char **cwd;
+		invocation->header = header;
+		if(!(cwd = get_strings(&p, record_end)) || !*cwd ||
+		!(invocation->argv = get_strings(&p, record_end)) || !*invocation->argv ||
+		!(invocation->command = get_strings(&p, record_end)) || !*invocation->command ||
+		!(invocation->environment = get_strings(&p, record_end))) {
+			fprintf(stderr, "%s: %s: truncated record at offset %ld\n", argv[0], log_file, (long int)(record_start - log));
+			return 1;
+		}
+		invocation->cwd = *cwd;
+		free(cwd);
+		if(!invocation->command[1] && strchr(*invocation->command, ' ')) {
+			invocation->command = split_command_line(*invocation->command);
+		}
+		p = record_end;
+	}
+
+	if(list) {
+		size_t i;
+		for(i = 0; i < count; i++) {
+			const struct record_header *header = &invocations[i].header;
+			printf("%s, status %d, %.3f ms (compiler %.3f ms), in %s\n", header->tool == RECORD_CL2CC ? "cl2cc" : "cc2cl",
+				(int)header->status, header->total_time / 1e3, header->compile_time / 1e3, invocations[i].cwd);
+			print_strings("argv", invocations[i].argv);
+			print_strings("command", invocations[i].command);
+			print_strings("environment", invocations[i].environment);
+		}
+		return 0;
+	}
+
+	size_t next = 0, running = 0, failed = 0, mismatched = 0;
+	uint64_t replay_time = 0, recorded_time = 0;
+	uint64_t start_time = stats_now();
+	while(next < count || running) {
+		while(next < count && running < jobs) {
+			struct invocation *invocation = invocations + next++;
+			invocation->start_time = stats_now();
+			invocation->pid = fork();
+			if(invocation->pid == -1) {
+				perror("fork");
+				return 1;
+			}
+			if(invocation->pid == 0) {
+				const char *cwd = directory ? directory : invocation->cwd;
+				if(chdir(cwd) < 0 && !directory) {
+					fprintf(stderr, "%s: warning: cannot change directory to %s, %s\n", argv[0], cwd, strerror(errno));
+				}
+				char **e = invocation->environment;
+				while(*e) {
+					if(restore_path || strncmp(*e, "PATH=", 5)) putenv(*e);
+					e++;
+				}
+				if(stub) {
+					setenv("CL_LOCATION", stub, 1);
+					setenv("CC_LOCATION", stub, 1);
+					setenv("CC", stub, 1);
+				}
+				if(quiet) {
+					int null_fd = open("/dev/null", O_WRONLY);
+					if(null_fd != -1) {
+						dup2(null_fd, 1);
+						dup2(null_fd, 2);
+					}
+				}
+				char **command = translated ? invocation->command : invocation->argv;
+				const char *file = translated ? (stub ? stub : *command) : (wrapper ? wrapper : *command);
+				execvp(file, command);
+				perror(file);
+				_exit(127);
+			}
+			running++;
+		}
+		int status;
+		pid_t pid = wait(&status);
+		if(pid < 0) {
+			if(errno == EINTR) continue;
+			perror("wait");
+			return 1;
+		}
+		size_t i;
+		for(i = 0; i < next; i++) if(invocations[i].pid == pid) break;
+		if(i == next) continue;
+		struct invocation *invocation = invocations + i;
+		invocation->pid = 0;
+		running--;
+		replay_time += stats_now() - invocation->start_time;
+		recorded_time += invocation->header.total_time;
+		int r = WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status) + 126;
+		if(r) failed++;
+		if(r != (invocation->header.status & 0xff)) mismatched++;
+	}
+	uint64_t wall_time = stats_now() - start_time;
+
+	printf("invocations: %lu, failed: %lu, status different from the record: %lu\n",
+		(unsigned long int)count, (unsigned long int)failed, (unsigned long int)mismatched);
+	printf("wall time: %.3f s, %.1f invocations/s with %u jobs\n", wall_time / 1e6, count ? count / (wall_time / 1e6) : 0.0, jobs);
+	printf("replayed: %.3f ms mean, recorded: %.3f ms mean\n",
+		count ? replay_time / 1e3 / count : 0.0, count ? recorded_time / 1e3 / count : 0.0);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,358 @@
+/*	Response file expansion shared by cl2cc and link2cl
+	Copyright 2015 libdll.so
+
+	This program is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation; either version 2 of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+*/
+
+/*
+	Every '@<file>' argument is replaced by the arguments in that file, which
+	may name more response files, up to RESPFILE_MAX_DEPTH deep.  A file is
+	split at spaces, tabs and line ends, with the quoting rules of the
+	Microsoft C runtime: double quotes group, and backslashes are only
+	special before a double quote.  Files in UTF-16, as MSBuild writes them,
+	are converted, to UTF-8 on POSIX and to the ANSI code page on Windows.
+
+	A file is mapped copy-on-write and split in place, so the arguments point
+	into the mapping and the file is never copied as a whole; the mappings
+	live until the program exits.  Runs of ordinary characters are skipped
+	16 bytes at a time with SSE2, or 8 at a time with plain word operations.
+
+	respfile_join() goes the other way, quoting arguments into a command
+	line or response file that splits back into them.
+*/
+
+#ifndef _RESPFILE_H
+#define _RESPFILE_H
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define RESPFILE_MAX_DEPTH 16
+
+struct respfile_argv {
+	char **v;
+	int count;
+	int max_count;
+};
+
+static inline void respfile_add(struct respfile_argv *args, char *arg) {
+	if(args->count + 1 >= args->max_count) {
+		args->max_count = args->max_count ? args->max_count * 2 : 256;
+		args->v = realloc(args->v, args->max_count * sizeof(char *));
+		if(!args->v) {
+			perror(NULL);
+			abort();
+		}
+	}
+	args->v[args->count++] = arg;
+	args->v[args->count] = NULL;
+}
+
+// Returns the first blank, line end, '"' or '\\' from p, or end
+static inline const char *respfile_find_special(const char *p, const char *end) {
+#ifdef __SSE2__
+	const __m128i space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('	'), cr = _mm_set1_epi8('\r'),
+		lf = _mm_set1_epi8('\n'), quote = _mm_set1_epi8('\"'), backslash = _mm_set1_epi8('\\');
+	while(end - p >= 16) {
+		__m128i b = _mm_loadu_si128((const __m128i *)p);
+		__m128i m = _mm_or_si128(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(b, space), _mm_cmpeq_epi8(b, tab)),
+			_mm_or_si128(_mm_cmpeq_epi8(b, cr), _mm_cmpeq_epi8(b, lf))),
+			_mm_or_si128(_mm_cmpeq_epi8(b, quote), _mm_cmpeq_epi8(b, backslash)));
+		int mask = _mm_movemask_epi8(m);
+		if(mask) return p + __builtin_ctz(mask);
+		p += 16;
+	}
+#else
+#define RESPFILE_ONES 0x0101010101010101ULL
+#define RESPFILE_HAS_ZERO(X) (((X) - RESPFILE_ONES) & ~(X) & (RESPFILE_ONES * 0x80))
+	while(end - p >= 8) {
+		uint64_t w;
+		memcpy(&w, p, sizeof w);
+		if(RESPFILE_HAS_ZERO(w ^ RESPFILE_ONES * ' ') || RESPFILE_HAS_ZERO(w ^ RESPFILE_ONES * '	') ||
+		RESPFILE_HAS_ZERO(w ^ RESPFILE_ONES * '\r') || RESPFILE_HAS_ZERO(w ^ RESPFILE_ONES * '\n') ||
+		RESPFILE_HAS_ZERO(w ^ RESPFILE_ONES * '\"') || RESPFILE_HAS_ZERO(w ^ RESPFILE_ONES * '\\')) break;
+		p += 8;
+	}
+#endif
+	while(p < end && *p != ' ' && *p != '	' && *p != '\r' && *p != '\n' && *p != '\"' && *p != '\\') p++;
+	return p;
+}
+
+static inline int respfile_expand_file(struct respfile_argv *args, const char *file, int depth);
+
+// Splits the buffer in place; the byte at end, if any, must be writable
+static inline int respfile_split(struct respfile_argv *args, char *p, char *end, int terminated, int depth) {
+	while(1) {
+		while(p < end && (*p == ' ' || *p == '	' || *p == '\r' || *p == '\n')) p++;
+		if(p == end) return 0;
+		int response_file = *p == '@';
+		char *arg = p, *w = p;
+		int quoted = 0;
+		while(1) {
+			const char *q = respfile_find_special(p, end);
+			if(w != p) memmove(w, p, q - p);
+			w += q - p;
+			p = (char *)q;
+			if(p == end) break;
+			if(*p == '\"') {
+				quoted = !quoted;
+				p++;
+			} else if(*p == '\\') {
+				size_t n = 0;
+				while(p < end && *p == '\\') n++, p++;
+				if(p < end && *p == '\"') {
+					memset(w, '\\', n / 2);
+					w += n / 2;
+					if(n % 2) *w++ = *p++;
+				} else {
+					memset(w, '\\', n);
+					w += n;
+				}
+			} else if(quoted) *w++ = *p++;
+			else {
+				p++;
+				break;
+			}
+		}
+		if(w == end && !terminated) {
+			// The last argument of a mapped file has no room for its NUL
+			size_t len = w - arg;
+			char *copy = malloc(len + 1);
+			if(!copy) {
+				perror(NULL);
+				abort();
+			}
+			memcpy(copy, arg, len);
+			copy[len] = 0;
+			arg = copy;
+		} else *w = 0;
+		if(response_file) {
+			if(respfile_expand_file(args, arg + 1, depth + 1) < 0) return -1;
+		} else respfile_add(args, arg);
+	}
+}
+
+// Returns a malloc'd buffer with the UTF-16 text converted
+static inline char *respfile_from_utf16(const unsigned char *data, size_t len, int big_endian, size_t *out_len) {
+	size_t count = len / 2, i;
+#ifdef _WIN32
+	wchar_t *w = malloc((count + 1) * sizeof(wchar_t));
+	if(!w) {
+		perror(NULL);
+		abort();
+	}
+	for(i = 0; i < count; i++) w[i] = big_endian ? data[2 * i] << 8 | data[2 * i + 1] : data[2 * i + 1] << 8 | data[2 * i];
+	int size = count ? WideCharToMultiByte(CP_ACP, 0, w, count, NULL, 0, NULL, NULL) : 0;
+	char *r = malloc(size + 1);
+	if(!r) {
+		perror(NULL);
+		abort();
+	}
+	if(count) WideCharToMultiByte(CP_ACP, 0, w, count, r, size, NULL, NULL);
+	free(w);
+	*out_len = size;
+#else
+	char *r = malloc(count * 3 + 1), *p = r;
+	if(!r) {
+		perror(NULL);
+		abort();
+	}
+	for(i = 0; i < count; i++) {
+		uint32_t c = big_endian ? data[2 * i] << 8 | data[2 * i + 1] : data[2 * i + 1] << 8 | data[2 * i];
+		if(c >= 0xd800 && c < 0xdc00 && i + 1 < count) {
+			uint32_t low = big_endian ? data[2 * i + 2] << 8 | data[2 * i + 3] : data[2 * i + 3] << 8 | data[2 * i + 2];
+			if(low >= 0xdc00 && low < 0xe000) {
+				c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+				i++;
+			}
+		}
+		if(c < 0x80) *p++ = c;
+		else if(c < 0x800) {
+			*p++ = 0xc0 | c >> 6;
+			*p++ = 0x80 | (c & 0x3f);
+		} else if(c < 0x10000) {
+			*p++ = 0xe0 | c >> 12;
+			*p++ = 0x80 | (c >> 6 & 0x3f);
+			*p++ = 0x80 | (c & 0x3f);
+		} else {
+			*p++ = 0xf0 | c >> 18;
+			*p++ = 0x80 | (c >> 12 & 0x3f);
+			*p++ = 0x80 | (c >> 6 & 0x3f);
+			*p++ = 0x80 | (c & 0x3f);
+		}
+	}
+	*out_len = p - r;
+#endif
+	return r;
+}
+
+// Maps the file privately, or reads it if it can't be mapped; returns NULL with errno set on error
+static inline char *respfile_map(const char *file, size_t *len) {
+#ifdef _WIN32
+	void *fh = CreateFileA(file, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(fh == INVALID_HANDLE_VALUE) {
+		errno = ENOENT;
+		return NULL;
+	}
+	LARGE_INTEGER size;
+	if(!GetFileSizeEx(fh, &size)) {
+		CloseHandle(fh);
+		errno = EIO;
+		return NULL;
+	}
+	*len = size.QuadPart;
+	if(!*len) {
+		CloseHandle(fh);
+		return "";
+	}
+	void *mh = CreateFileMappingA(fh, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	CloseHandle(fh);
+	char *r = mh ? MapViewOfFile(mh, FILE_MAP_COPY, 0, 0, 0) : NULL;
+	if(mh) CloseHandle(mh);
+	if(!r) errno = ENOMEM;
+	return r;
+#else
+	int fd = open(file, O_RDONLY);
+	if(fd == -1) return NULL;
+	struct stat st;
+	if(fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+	char *r;
+	if(S_ISREG(st.st_mode)) {
+		*len = st.st_size;
+		if(!*len) {
+			close(fd);
+			return "";
+		}
+		r = mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if(r != MAP_FAILED) {
+			close(fd);
+			return r;
+		}
+	}
+	// A pipe, or a file system that can't map
+	size_t max_len = 65536;
+	*len = 0;
+	if(!(r = malloc(max_len))) {
+		perror(NULL);
+		abort();
+	}
+	while(1) {
+		if(*len == max_len && !(r = realloc(r, max_len *= 2))) {
+			perror(NULL);
+			abort();
+		}
+		ssize_t s = read(fd, r + *len, max_len - *len);
+		if(s < 0) {
+			if(errno == EINTR) continue;
+			int e = errno;
+			free(r);
+			close(fd);
+			errno = e;
+			return NULL;
+		}
+		if(!s) break;
+		*len += s;
+	}
+	close(fd);
+	return r;
+#endif
+}
+
+static inline int respfile_expand_file(struct respfile_argv *args, const char *file, int depth) {
+	if(depth > RESPFILE_MAX_DEPTH) {
+		fprintf(stderr, "error: response file %s is nested too deeply\n", file);
+		return -1;
+	}
+	size_t len;
+	char *data = respfile_map(file, &len);
+	if(!data) {
+		fprintf(stderr, "error: cannot read response file %s, %s\n", file, strerror(errno));
+		return -1;
+	}
+	const unsigned char *u = (const unsigned char *)data;
+	if(len >= 2 && ((u[0] == 0xff && u[1] == 0xfe) || (u[0] == 0xfe && u[1] == 0xff))) {
+		data = respfile_from_utf16(u + 2, len - 2, u[0] == 0xfe, &len);
+		return respfile_split(args, data, data + len, 1, depth);
+	}
+	// Without a byte order mark, ASCII text in UTF-16 still has every other byte 0
+	if(len >= 2 && u[0] && !u[1]) {
+		data = respfile_from_utf16(u, len, 0, &len);
+		return respfile_split(args, data, data + len, 1, depth);
+	}
+	if(len >= 3 && u[0] == 0xef && u[1] == 0xbb && u[2] == 0xbf) data += 3, len -= 3;
+	return respfile_split(args, data, data + len, 0, depth);
+}
+
+/*	Returns argv with the response files expanded and sets *argc, or argv
+	itself if it names none; NULL after printing an error.
+*/
+static inline char **respfile_expand(int *argc, char **argv) {
+	int i;
+	for(i = 1; i < *argc; i++) if(*argv[i] == '@') break;
+	if(i == *argc) return argv;
+	struct respfile_argv args = { NULL, 0, 0 };
+	for(i = 0; i < *argc; i++) {
+		if(i && *argv[i] == '@') {
+			if(respfile_expand_file(&args, argv[i] + 1, 1) < 0) return NULL;
+		} else respfile_add(&args, argv[i]);
+	}
+	*argc = args.count;
+	return args.v;
+}
+
+// Joins argv into one command line, or response file, that splits back into the same arguments
+static inline char *respfile_join(char **argv) {
+	size_t len = 0;
+	unsigned int i;
+	for(i = 0; argv[i]; i++) len += 2 * strlen(argv[i]) + 3;
+	char *command_line = malloc(len + 1), *p = command_line;
+	if(!command_line) {
+		perror(NULL);
+		abort();
+	}
+	for(i = 0; argv[i]; i++) {
+		const char *s = argv[i];
+		if(i) *p++ = ' ';
+		if(*s && !strpbrk(s, " 	\r\n\"")) {
+			size_t len = strlen(s);
+			memcpy(p, s, len);
+			p += len;
+			continue;
+		}
+		*p++ = '\"';
+		while(1) {
+			size_t backslashes = strspn(s, "\\");
+			s += backslashes;
+			// Backslashes are only special before a quote, the closing one included
+			if(!*s || *s == '\"') backslashes = backslashes * 2 + (*s == '\"');
+			memset(p, '\\', backslashes);
+			p += backslashes;
+			if(!*s) break;
+			*p++ = *s++;
+		}
+		*p++ = '\"';
+	}
+	*p = 0;
+	return command_line;
+}
+
+#endif
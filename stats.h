@@ -0,0 +1,198 @@
+/*	Build statistics shared by cc2cl and cl2cc
+	Copyright 2015 libdll.so
+
+	This program is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation; either version 2 of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+*/
+
+/*
+	The counters live in a file named by BUILD_STATS_FILE, mapped shared by
+	every wrapper process of the build.  All updates are relaxed atomic adds,
+	so the file needs no locking and a zero-filled file is a valid empty set.
+*/
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define STATS_MAGIC 0x31545343		// "CST1"
+
+#define STATS_CC2CL 0
+#define STATS_CL2CC 1
+#define STATS_TOOL_COUNT 2
+
+// Bucket 0 counts compiles under 1 ms, bucket n those in [2^(n-1), 2^n) ms
+#define STATS_HISTOGRAM_SIZE 20
+
+struct build_stats {
+	uint32_t magic;
+	uint32_t reserved;
+	uint64_t invocations[STATS_TOOL_COUNT];
+	uint64_t failures;
+	uint64_t compile_time;		// In microseconds
+	uint64_t overhead_time;		// In microseconds
+	uint64_t bytes_produced;
+	uint64_t compile_time_histogram[STATS_HISTOGRAM_SIZE];
+};
+
+static uint64_t stats_start_time;
+static uint64_t stats_compile_start_time;
+static uint64_t stats_compile_time;
+
+static inline uint64_t stats_now() {
+#ifdef _WIN32
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	if(!frequency.QuadPart) QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return counter.QuadPart / frequency.QuadPart * 1000000 + counter.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static inline void stats_unmap(struct build_stats *stats) {
+#ifdef _WIN32
+	UnmapViewOfFile(stats);
+#else
+	munmap(stats, sizeof(struct build_stats));
+#endif
+}
+
+static inline struct build_stats *stats_map() {
+	const char *file = getenv("BUILD_STATS_FILE");
+	if(!file || !*file) return NULL;
+	struct build_stats *stats;
+#ifdef _WIN32
+	void *fh = CreateFileA(file, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(fh == INVALID_HANDLE_VALUE) return NULL;
+	// The mapping grows the file to the requested size
+	void *mh = CreateFileMappingA(fh, NULL, PAGE_READWRITE, 0, sizeof(struct build_stats), NULL);
+	CloseHandle(fh);
+	if(!mh) return NULL;
+	stats = MapViewOfFile(mh, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(struct build_stats));
+	CloseHandle(mh);
+	if(!stats) return NULL;
+#else
+	int fd = open(file, O_RDWR | O_CREAT, 0666);
+	if(fd == -1) return NULL;
+	struct stat st;
+	if(fstat(fd, &st) < 0 || (st.st_size < sizeof(struct build_stats) && ftruncate(fd, sizeof(struct build_stats)) < 0)) {
+		close(fd);
+		return NULL;
+	}
+	stats = mmap(NULL, sizeof(struct build_stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(stats == MAP_FAILED) return NULL;
+#endif
+	uint32_t magic = 0;
+	if(!__atomic_compare_exchange_n(&stats->magic, &magic, STATS_MAGIC, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) && magic != STATS_MAGIC) {
+		fprintf(stderr, "warning: %s is not a build statistics file\n", file);
+		stats_unmap(stats);
+		return NULL;
+	}
+	return stats;
+}
+
+static inline void stats_begin() {
+	stats_start_time = stats_now();
+}
+
+static inline void stats_compile_begin() {
+	stats_compile_start_time = stats_now();
+}
+
+static inline void stats_compile_end() {
+	stats_compile_time += stats_now() - stats_compile_start_time;
+}
+
+static inline long long int stats_file_size(const char *file) {
+#ifdef _WIN32
+	WIN32_FILE_ATTRIBUTE_DATA attr;
+	if(!GetFileAttributesExA(file, GetFileExInfoStandard, &attr)) return -1;
+	return (long long int)attr.nFileSizeHigh << 32 | attr.nFileSizeLow;
+#else
+	struct stat st;
+	if(stat(file, &st) < 0) return -1;
+	return st.st_size;
+#endif
+}
+
+#define STATS_ADD(FIELD,N) __atomic_fetch_add(&(FIELD), (N), __ATOMIC_RELAXED)
+
+// Call once, after the compiler has exited
+static inline void stats_end(int tool, int status, const char *output) {
+	if(!stats_start_time) return;
+	uint64_t total_time = stats_now() - stats_start_time;
+	struct build_stats *stats = stats_map();
+	if(!stats) return;
+	STATS_ADD(stats->invocations[tool], 1);
+	if(status) STATS_ADD(stats->failures, 1);
+	STATS_ADD(stats->compile_time, stats_compile_time);
+	STATS_ADD(stats->overhead_time, total_time > stats_compile_time ? total_time - stats_compile_time : 0);
+	uint64_t ms = stats_compile_time / 1000;
+	int i = 0;
+	while(ms && i < STATS_HISTOGRAM_SIZE - 1) {
+		ms >>= 1;
+		i++;
+	}
+	STATS_ADD(stats->compile_time_histogram[i], 1);
+	if(!status && output) {
+		long long int size = stats_file_size(output);
+		if(size > 0) STATS_ADD(stats->bytes_produced, size);
+	}
+	stats_unmap(stats);
+}
+
+static inline int stats_print(FILE *f) {
+	struct build_stats *stats = stats_map();
+	if(!stats) return -1;
+	uint64_t invocations = 0, compile_time, overhead_time;
+	int i;
+	for(i = 0; i < STATS_TOOL_COUNT; i++) invocations += __atomic_load_n(&stats->invocations[i], __ATOMIC_RELAXED);
+	compile_time = __atomic_load_n(&stats->compile_time, __ATOMIC_RELAXED);
+	overhead_time = __atomic_load_n(&stats->overhead_time, __ATOMIC_RELAXED);
+	fprintf(f, "invocations: %llu (cc2cl %llu, cl2cc %llu)\n", (unsigned long long int)invocations,
+		(unsigned long long int)__atomic_load_n(&stats->invocations[STATS_CC2CL], __ATOMIC_RELAXED),
+		(unsigned long long int)__atomic_load_n(&stats->invocations[STATS_CL2CC], __ATOMIC_RELAXED));
+	fprintf(f, "failures: %llu\n", (unsigned long long int)__atomic_load_n(&stats->failures, __ATOMIC_RELAXED));
+	fprintf(f, "compile time: %.3f s total, %.3f ms mean\n", compile_time / 1e6, invocations ? compile_time / 1e3 / invocations : 0.0);
+	fprintf(f, "wrapper overhead: %.3f s total, %.3f ms mean\n", overhead_time / 1e6, invocations ? overhead_time / 1e3 / invocations : 0.0);
+	fprintf(f, "bytes produced: %llu\n", (unsigned long long int)__atomic_load_n(&stats->bytes_produced, __ATOMIC_RELAXED));
+	fputs("compile time histogram:\n", f);
+	for(i = 0; i < STATS_HISTOGRAM_SIZE; i++) {
+		uint64_t n = __atomic_load_n(&stats->compile_time_histogram[i], __ATOMIC_RELAXED);
+		if(!n) continue;
+		if(i == 0) fprintf(f, "\t< 1 ms: %llu\n", (unsigned long long int)n);
+		else if(i == STATS_HISTOGRAM_SIZE - 1) fprintf(f, "\t>= %lu ms: %llu\n", 1UL << (i - 1), (unsigned long long int)n);
+		else fprintf(f, "\t%lu - %lu ms: %llu\n", 1UL << (i - 1), (1UL << i) - 1, (unsigned long long int)n);
+	}
+	stats_unmap(stats);
+	return 0;
+}
+
+static inline int stats_reset() {
+	struct build_stats *stats = stats_map();
+	if(!stats) return -1;
+	uint64_t *p = stats->invocations;
+	while(p < (uint64_t *)(stats + 1)) __atomic_store_n(p++, 0, __ATOMIC_RELAXED);
+	stats_unmap(stats);
+	return 0;
+}
+
+#endif